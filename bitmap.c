@@ -0,0 +1,204 @@
+// Bitmap scans work on 64-bit words: a full word is skipped with one compare
+// and the first clear bit of a word is found with __builtin_ctzll. On x86-64
+// CPUs with AVX2, runs of full words are skipped 256 bits at a time.
+#include "bitmap.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define BITMAP_HAVE_AVX2 1
+#endif
+
+static inline uint64_t load_word(const uint8_t *bmp, uint64_t w) {
+    uint64_t v; memcpy(&v, bmp + w * 8, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static uint64_t skip_full_scalar(const uint8_t *bmp, uint64_t w, uint64_t wend) {
+    while (w < wend && load_word(bmp, w) == UINT64_MAX) w++;
+    return w;
+}
+
+#ifdef BITMAP_HAVE_AVX2
+__attribute__((target("avx2")))
+static uint64_t skip_full_avx2(const uint8_t *bmp, uint64_t w, uint64_t wend) {
+    const __m256i ones = _mm256_set1_epi32(-1);
+    while (w + 4 <= wend) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(bmp + w * 8));
+        if (!_mm256_testc_si256(v, ones)) break;
+        w += 4;
+    }
+    return skip_full_scalar(bmp, w, wend);
+}
+#endif
+
+// Returns the index of the first word in [w, wend) that has a clear bit.
+static uint64_t skip_full_words(const uint8_t *bmp, uint64_t w, uint64_t wend) {
+#ifdef BITMAP_HAVE_AVX2
+    static int use_avx2 = -1;
+    if (use_avx2 < 0) {
+        __builtin_cpu_init();
+        use_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    if (use_avx2) return skip_full_avx2(bmp, w, wend);
+#endif
+    return skip_full_scalar(bmp, w, wend);
+}
+
+uint64_t bitmap_next_free(const uint8_t *bmp, uint64_t nbits, uint64_t from) {
+    if (from >= nbits) return BITMAP_NONE;
+    uint64_t wend = (nbits + 63) / 64;
+    uint64_t w = from / 64;
+    uint64_t word = ~load_word(bmp, w) & (UINT64_MAX << (from % 64));
+    while (!word) {
+        w = skip_full_words(bmp, w + 1, wend);
+        if (w >= wend) return BITMAP_NONE;
+        word = ~load_word(bmp, w);
+    }
+    uint64_t bit = w * 64 + (uint64_t)__builtin_ctzll(word);
+    return bit < nbits ? bit : BITMAP_NONE;
+}
+
+uint64_t bitmap_next_used(const uint8_t *bmp, uint64_t nbits, uint64_t from) {
+    if (from >= nbits) return nbits;
+    uint64_t wend = (nbits + 63) / 64;
+    uint64_t w = from / 64;
+    uint64_t word = load_word(bmp, w) & (UINT64_MAX << (from % 64));
+    while (!word) {
+        if (++w >= wend) return nbits;
+        word = load_word(bmp, w);
+    }
+    uint64_t bit = w * 64 + (uint64_t)__builtin_ctzll(word);
+    return bit < nbits ? bit : nbits;
+}
+
+uint64_t bitmap_find_free(const uint8_t *bmp, uint64_t nbits, uint64_t hint) {
+    if (hint >= nbits) hint = 0;
+    uint64_t bit = bitmap_next_free(bmp, nbits, hint);
+    if (bit == BITMAP_NONE && hint > 0) bit = bitmap_next_free(bmp, hint, 0);
+    return bit;
+}
+
+typedef struct {
+    uint64_t start, len;
+} bit_run_t;
+
+static int cmp_run_len_desc(const void *a, const void *b) {
+    const bit_run_t *x = a, *y = b;
+    if (x->len != y->len) return x->len > y->len ? -1 : 1;
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+static int cmp_run_start(const void *a, const void *b) {
+    const bit_run_t *x = a, *y = b;
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+// Distance from the hint to `start`, going forward and wrapping at nbits.
+static uint64_t hint_distance(uint64_t start, uint64_t hint, uint64_t nbits) {
+    return start >= hint ? start - hint : nbits - hint + start;
+}
+
+// Best fit looks at the free runs that start within this many bits after the
+// hint first (one 4 KiB bitmap block), so an allocation costs a window scan
+// rather than a scan of the whole bitmap.
+#define BEST_FIT_WINDOW (1u << 15)
+
+// Best fit: the shortest free run starting in [from, to) that holds all n
+// bits, so long runs stay available for large files. Ties go to the run
+// nearest after the hint. A run's length is only measured as far as `to` or
+// n bits, whichever is further, so the scan never walks a long free run to
+// its end. Also reports how many free runs start in the range.
+static uint64_t best_fit_in(const uint8_t *bmp, uint64_t nbits, uint64_t from, uint64_t to, uint64_t n,
+                            uint64_t hint, uint64_t *nruns) {
+    uint64_t best = BITMAP_NONE, best_len = UINT64_MAX;
+    *nruns = 0;
+    for (uint64_t start = bitmap_next_free(bmp, to, from); start != BITMAP_NONE;) {
+        uint64_t limit = to > start + n ? to : start + n;
+        uint64_t end = bitmap_next_used(bmp, limit < nbits ? limit : nbits, start);
+        uint64_t len = end - start;
+        (*nruns)++;
+        if (len >= n && (len < best_len || (len == best_len &&
+                         hint_distance(start, hint, nbits) < hint_distance(best, hint, nbits)))) {
+            best = start;
+            best_len = len;
+        }
+        start = bitmap_next_free(bmp, to, end);
+    }
+    return best;
+}
+
+// The window after the hint first, then the whole bitmap.
+static uint64_t best_fit_run(const uint8_t *bmp, uint64_t nbits, uint64_t n, uint64_t hint, uint64_t *nruns) {
+    if (hint >= nbits) hint = 0;
+    if (nbits - hint > BEST_FIT_WINDOW) {
+        uint64_t best = best_fit_in(bmp, nbits, hint, hint + BEST_FIT_WINDOW, n, hint, nruns);
+        if (best != BITMAP_NONE) return best;
+    }
+    return best_fit_in(bmp, nbits, 0, nbits, n, hint, nruns);
+}
+
+uint64_t bitmap_find_run(const uint8_t *bmp, uint64_t nbits, uint64_t n, uint64_t hint) {
+    uint64_t nruns;
+    return n ? best_fit_run(bmp, nbits, n, hint, &nruns) : BITMAP_NONE;
+}
+
+uint64_t bitmap_find_free_n(const uint8_t *bmp, uint64_t nbits, uint64_t n, uint64_t hint, uint64_t *out) {
+    if (n == 0) return 0;
+
+    uint64_t nruns;
+    uint64_t best = best_fit_run(bmp, nbits, n, hint, &nruns);
+    if (best != BITMAP_NONE) {
+        for (uint64_t i = 0; i < n; i++) out[i] = best + i;
+        return n;
+    }
+    if (nruns == 0) return 0;
+
+    // No run is long enough: fill from the longest runs first, which uses the
+    // fewest fragments, then hand the bits out in disk order.
+    bit_run_t *runs = malloc(nruns * sizeof(bit_run_t));
+    uint64_t found = 0;
+    if (!runs) {
+        // Out of memory: still succeed, just without the fragment minimisation.
+        for (uint64_t bit = bitmap_next_free(bmp, nbits, 0); bit != BITMAP_NONE && found < n;
+             bit = bitmap_next_free(bmp, nbits, bit + 1))
+            out[found++] = bit;
+        return found;
+    }
+    uint64_t r = 0;
+    for (uint64_t start = bitmap_next_free(bmp, nbits, 0); start != BITMAP_NONE;) {
+        uint64_t end = bitmap_next_used(bmp, nbits, start);
+        runs[r].start = start;
+        runs[r].len = end - start;
+        r++;
+        start = bitmap_next_free(bmp, nbits, end);
+    }
+    qsort(runs, nruns, sizeof(bit_run_t), cmp_run_len_desc);
+    uint64_t used = 0, want = n;
+    while (used < nruns && want > 0) {
+        if (runs[used].len > want) runs[used].len = want;
+        want -= runs[used].len;
+        used++;
+    }
+    qsort(runs, used, sizeof(bit_run_t), cmp_run_start);
+    for (uint64_t i = 0; i < used; i++)
+        for (uint64_t b = 0; b < runs[i].len; b++) out[found++] = runs[i].start + b;
+    free(runs);
+    return found;
+}
+
+void bitmap_free_runs(const uint8_t *bmp, uint64_t nbits, bitmap_run_stats_t *st) {
+    memset(st, 0, sizeof(*st));
+    for (uint64_t start = bitmap_next_free(bmp, nbits, 0); start != BITMAP_NONE;) {
+        uint64_t end = bitmap_next_used(bmp, nbits, start);
+        st->runs++;
+        st->free_bits += end - start;
+        if (end - start > st->largest_run) st->largest_run = end - start;
+        start = bitmap_next_free(bmp, nbits, end);
+    }
+}
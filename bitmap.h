@@ -0,0 +1,56 @@
+// Free-bit search over the inode and data bitmaps.
+// Bit i lives in byte i/8 at position i%8, as in the on-disk format.
+#ifndef MINIVSFS_BITMAP_H
+#define MINIVSFS_BITMAP_H
+
+#include <stdint.h>
+
+#define BITMAP_NONE UINT64_MAX
+
+static inline int bitmap_test(const uint8_t *bmp, uint64_t i) {
+    return (bmp[i / 8] >> (i % 8)) & 1;
+}
+
+static inline void bitmap_set(uint8_t *bmp, uint64_t i) {
+    bmp[i / 8] |= (uint8_t)(1u << (i % 8));
+}
+
+static inline void bitmap_clear(uint8_t *bmp, uint64_t i) {
+    bmp[i / 8] &= (uint8_t)~(1u << (i % 8));
+}
+
+// Returns the first clear bit in [from, nbits), or BITMAP_NONE. The bitmap
+// must be readable in whole 64-bit words up to round_up(nbits, 64), which
+// holds for bitmaps made of whole blocks.
+uint64_t bitmap_next_free(const uint8_t *bmp, uint64_t nbits, uint64_t from);
+
+// Next-fit: first clear bit at or after `hint`, wrapping around to 0.
+uint64_t bitmap_find_free(const uint8_t *bmp, uint64_t nbits, uint64_t hint);
+
+// First set bit in [from, nbits), or nbits if the rest is clear.
+uint64_t bitmap_next_used(const uint8_t *bmp, uint64_t nbits, uint64_t from);
+
+// Finds `n` clear bits for one file, keeping its data contiguous where
+// possible: the shortest free run that holds all `n` bits is chosen (best
+// fit, ties broken by nearness after `hint`), looking first only at the runs
+// that start in a window after `hint` and at the whole bitmap only when none
+// of those fits. If no run is long enough the
+// longest runs are combined, giving the fewest fragments. Bit numbers are
+// stored in `out` in ascending order. Returns how many were found (less than
+// `n` only if the bitmap is too full). Nothing is set; callers mark the bits
+// they keep.
+uint64_t bitmap_find_free_n(const uint8_t *bmp, uint64_t nbits, uint64_t n, uint64_t hint, uint64_t *out);
+
+// Start of the best-fit run of `n` contiguous clear bits, or BITMAP_NONE.
+uint64_t bitmap_find_run(const uint8_t *bmp, uint64_t nbits, uint64_t n, uint64_t hint);
+
+typedef struct {
+    uint64_t free_bits;
+    uint64_t runs;          // number of maximal runs of clear bits
+    uint64_t largest_run;
+} bitmap_run_stats_t;
+
+// Summarises free space as runs of clear bits, for fragmentation reports.
+void bitmap_free_runs(const uint8_t *bmp, uint64_t nbits, bitmap_run_stats_t *st);
+
+#endif
@@ -0,0 +1,159 @@
+// Chunk codecs. The LZ4 block format is implemented here (greedy matching
+// over a 4096-entry hash table, the same format the lz4 library reads and
+// writes), so the tools build without external libraries. Chunks are at most
+// 64 KiB, which keeps every match offset within LZ4's 16-bit range.
+#include "compress.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef MVFS_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define LZ4_MIN_MATCH    4
+#define LZ4_LAST_LITERALS 5    // the last 5 bytes are always literals
+#define LZ4_MF_LIMIT     12    // no match starts in the last 12 bytes
+#define LZ4_MAX_OFFSET   65535u
+#define LZ4_HASH_BITS    12
+
+static inline uint32_t load32(const uint8_t* p) {
+    uint32_t v; memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Appends an LZ4 length continuation (the part of `len` beyond the token's 15).
+static void put_length(uint8_t* dst, size_t* o, size_t len) {
+    while (len >= 255) {
+        dst[(*o)++] = 255;
+        len -= 255;
+    }
+    dst[(*o)++] = (uint8_t)len;
+}
+
+// Writes one sequence: `lit` literals from `src`, then (if `match_len`) a
+// match of that length at distance `offset`. Returns 0 if it does not fit.
+static int put_sequence(uint8_t* dst, size_t* o, size_t cap, const uint8_t* src, size_t lit,
+                        size_t offset, size_t match_len) {
+    size_t ml = match_len ? match_len - LZ4_MIN_MATCH : 0;
+    size_t need = 1 + lit / 255 + 1 + lit + (match_len ? 2 + ml / 255 + 1 : 0);
+    if (need > cap - *o) return 0;
+    dst[(*o)++] = (uint8_t)((lit >= 15 ? 15 : lit) << 4 | (ml >= 15 ? 15 : ml));
+    if (lit >= 15) put_length(dst, o, lit - 15);
+    memcpy(dst + *o, src, lit);
+    *o += lit;
+    if (match_len) {
+        dst[(*o)++] = (uint8_t)offset;
+        dst[(*o)++] = (uint8_t)(offset >> 8);
+        if (ml >= 15) put_length(dst, o, ml - 15);
+    }
+    return 1;
+}
+
+static size_t lz4_compress(const uint8_t* src, size_t n, uint8_t* dst, size_t cap) {
+    uint32_t table[1u << LZ4_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    size_t anchor = 0, o = 0;
+    if (n > LZ4_MF_LIMIT) {
+        for (size_t i = 0; i < n - LZ4_MF_LIMIT;) {
+            uint32_t seq = load32(src + i);
+            uint32_t h = (seq * 2654435761u) >> (32 - LZ4_HASH_BITS);
+            size_t cand = table[h];
+            table[h] = (uint32_t)i;
+            if (cand >= i || i - cand > LZ4_MAX_OFFSET || load32(src + cand) != seq) {
+                i++;
+                continue;
+            }
+            size_t end = i + LZ4_MIN_MATCH, c = cand + LZ4_MIN_MATCH;
+            while (end < n - LZ4_LAST_LITERALS && src[end] == src[c]) end++, c++;
+            while (i > anchor && cand > 0 && src[i - 1] == src[cand - 1]) i--, cand--;
+            if (!put_sequence(dst, &o, cap, src + anchor, i - anchor, i - cand, end - i)) return 0;
+            anchor = i = end;
+        }
+    }
+    if (!put_sequence(dst, &o, cap, src + anchor, n - anchor, 0, 0)) return 0;
+    return o;
+}
+
+static int lz4_decompress(const uint8_t* src, size_t len, uint8_t* dst, size_t n) {
+    size_t i = 0, o = 0;
+    while (i < len) {
+        uint8_t token = src[i++];
+        size_t lit = token >> 4;
+        if (lit == 15) {
+            uint8_t b;
+            do {
+                if (i >= len) return -1;
+                b = src[i++];
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > len - i || lit > n - o) return -1;
+        memcpy(dst + o, src + i, lit);
+        i += lit;
+        o += lit;
+        if (i == len) break;    // the last sequence has no match
+        if (len - i < 2) return -1;
+        size_t offset = src[i] | (size_t)src[i + 1] << 8;
+        i += 2;
+        size_t ml = token & 15;
+        if (ml == 15) {
+            uint8_t b;
+            do {
+                if (i >= len) return -1;
+                b = src[i++];
+                ml += b;
+            } while (b == 255);
+        }
+        ml += LZ4_MIN_MATCH;
+        if (offset == 0 || offset > o || ml > n - o) return -1;
+        // Overlapping matches repeat the last `offset` bytes.
+        if (offset >= ml) {
+            memcpy(dst + o, dst + o - offset, ml);
+        } else {
+            for (size_t k = 0; k < ml; k++) dst[o + k] = dst[o + k - offset];
+        }
+        o += ml;
+    }
+    return o == n ? 0 : -1;
+}
+
+int compress_parse(const char* name) {
+    int alg = !strcmp(name, "lz4") ? COMPRESS_LZ4 : !strcmp(name, "zstd") ? COMPRESS_ZSTD : -1;
+    if (alg < 0) fprintf(stderr, "Unknown compression '%s' (lz4 or zstd).\n", name);
+    else if (!compress_available((unsigned)alg)) {
+        fprintf(stderr, "%s support is not built in (build with -DMVFS_HAVE_ZSTD and -lzstd).\n", name);
+        alg = -1;
+    }
+    return alg;
+}
+
+int compress_available(unsigned alg) {
+    if (alg == COMPRESS_LZ4) return 1;
+#ifdef MVFS_HAVE_ZSTD
+    if (alg == COMPRESS_ZSTD) return 1;
+#endif
+    return 0;
+}
+
+size_t chunk_compress(unsigned alg, const uint8_t* src, size_t n, uint8_t* dst, size_t cap) {
+    if (alg == COMPRESS_LZ4) return lz4_compress(src, n, dst, cap);
+#ifdef MVFS_HAVE_ZSTD
+    if (alg == COMPRESS_ZSTD) {
+        size_t r = ZSTD_compress(dst, cap, src, n, 3);
+        return ZSTD_isError(r) ? 0 : r;
+    }
+#endif
+    return 0;
+}
+
+int chunk_decompress(unsigned alg, const uint8_t* src, size_t len, uint8_t* dst, size_t n) {
+    if (alg == COMPRESS_LZ4) return lz4_decompress(src, len, dst, n);
+#ifdef MVFS_HAVE_ZSTD
+    if (alg == COMPRESS_ZSTD) {
+        size_t r = ZSTD_decompress(dst, n, src, len);
+        return !ZSTD_isError(r) && r == n ? 0 : -1;
+    }
+#endif
+    return -1;
+}
@@ -0,0 +1,27 @@
+// Chunk codecs for compressed files. LZ4 (block format) is built in; zstd is
+// used when the build defines MVFS_HAVE_ZSTD and links -lzstd.
+#ifndef MINIVSFS_COMPRESS_H
+#define MINIVSFS_COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Algorithm numbers, as stored in compressed inodes.
+#define COMPRESS_NONE 0
+#define COMPRESS_LZ4  1
+#define COMPRESS_ZSTD 2
+
+// Algorithm named `name` ("lz4", "zstd"), or -1 with a message when it is
+// unknown or not built in. For command-line options.
+int compress_parse(const char* name);
+// Non-zero when this build can compress and decompress with `alg`.
+int compress_available(unsigned alg);
+
+// Compresses `n` bytes of `src` into at most `cap` bytes of `dst`. Returns the
+// compressed size, or 0 if it does not fit (the data is then stored as is).
+size_t chunk_compress(unsigned alg, const uint8_t* src, size_t n, uint8_t* dst, size_t cap);
+// Decompresses `len` bytes of `src`, which must produce exactly `n` bytes in
+// `dst`. Returns 0, or -1 for corrupt input or an unavailable algorithm.
+int chunk_decompress(unsigned alg, const uint8_t* src, size_t len, uint8_t* dst, size_t n);
+
+#endif
@@ -0,0 +1,295 @@
+// CRC32 engines: byte-at-a-time, slice-by-8, slice-by-16 and, on x86-64,
+// PCLMULQDQ folding. All compute the same reflected 0xEDB88320 CRC; the
+// internal helpers work on the running (pre-inverted) register value.
+// CRC32C has a slice-by-8 engine and, on x86-64, the SSE4.2 instruction.
+#include "crc32.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CRC32_HAVE_PCLMUL 1
+#define CRC32C_HAVE_SSE42 1
+#endif
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define CRC32_HAVE_SLICING 1
+#endif
+
+static uint32_t crc32_tab[16][256];
+
+typedef uint32_t (*crc32_fn)(uint32_t c, const uint8_t* p, size_t n);
+static crc32_fn crc32_impl;
+static const char* crc32_impl_name = "slice8";
+
+static uint32_t crc32c_tab[8][256];
+static int crc32c_hw;
+
+static uint32_t update_bytewise(uint32_t c, const uint8_t* p, size_t n) {
+    for (size_t i = 0; i < n; i++) c = crc32_tab[0][(c ^ p[i]) & 0xFF] ^ (c >> 8);
+    return c;
+}
+
+#ifdef CRC32_HAVE_SLICING
+static inline uint32_t load32(const uint8_t* p) {
+    uint32_t v; memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t update_slice8(uint32_t c, const uint8_t* p, size_t n) {
+    while (n >= 8) {
+        uint32_t lo = load32(p) ^ c, hi = load32(p + 4);
+        c = crc32_tab[7][lo & 0xFF] ^ crc32_tab[6][(lo >> 8) & 0xFF] ^
+            crc32_tab[5][(lo >> 16) & 0xFF] ^ crc32_tab[4][lo >> 24] ^
+            crc32_tab[3][hi & 0xFF] ^ crc32_tab[2][(hi >> 8) & 0xFF] ^
+            crc32_tab[1][(hi >> 16) & 0xFF] ^ crc32_tab[0][hi >> 24];
+        p += 8; n -= 8;
+    }
+    return update_bytewise(c, p, n);
+}
+
+static uint32_t update_slice16(uint32_t c, const uint8_t* p, size_t n) {
+    while (n >= 16) {
+        uint32_t w0 = load32(p) ^ c, w1 = load32(p + 4), w2 = load32(p + 8), w3 = load32(p + 12);
+        c = crc32_tab[15][w0 & 0xFF] ^ crc32_tab[14][(w0 >> 8) & 0xFF] ^
+            crc32_tab[13][(w0 >> 16) & 0xFF] ^ crc32_tab[12][w0 >> 24] ^
+            crc32_tab[11][w1 & 0xFF] ^ crc32_tab[10][(w1 >> 8) & 0xFF] ^
+            crc32_tab[9][(w1 >> 16) & 0xFF] ^ crc32_tab[8][w1 >> 24] ^
+            crc32_tab[7][w2 & 0xFF] ^ crc32_tab[6][(w2 >> 8) & 0xFF] ^
+            crc32_tab[5][(w2 >> 16) & 0xFF] ^ crc32_tab[4][w2 >> 24] ^
+            crc32_tab[3][w3 & 0xFF] ^ crc32_tab[2][(w3 >> 8) & 0xFF] ^
+            crc32_tab[1][(w3 >> 16) & 0xFF] ^ crc32_tab[0][w3 >> 24];
+        p += 16; n -= 16;
+    }
+    return update_bytewise(c, p, n);
+}
+#else
+#define update_slice8 update_bytewise
+#define update_slice16 update_bytewise
+#endif
+
+#ifdef CRC32_HAVE_PCLMUL
+// Folding constants for the reflected 0xEDB88320 polynomial (x^n mod P for the
+// 512/128/64-bit fold distances) and the Barrett reduction pair, as published
+// in Intel's "Fast CRC Computation Using PCLMULQDQ" white paper.
+static const uint64_t k1k2[2] __attribute__((aligned(16))) = { 0x0154442bd4, 0x01c6e41596 };
+static const uint64_t k3k4[2] __attribute__((aligned(16))) = { 0x01751997d0, 0x00ccaa009e };
+static const uint64_t k5k0[2] __attribute__((aligned(16))) = { 0x0163cd6124, 0x0000000000 };
+static const uint64_t poly[2] __attribute__((aligned(16))) = { 0x01db710641, 0x01f7011641 };
+
+#define FOLD(x, k, y) _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128((x), (k), 0x11), \
+                                                  _mm_clmulepi64_si128((x), (k), 0x00)), (y))
+
+// Requires n >= 64 and n % 16 == 0.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t fold_pclmul(uint32_t c, const uint8_t* p, size_t n) {
+    __m128i x1 = _mm_loadu_si128((const __m128i*)(p + 0x00));
+    __m128i x2 = _mm_loadu_si128((const __m128i*)(p + 0x10));
+    __m128i x3 = _mm_loadu_si128((const __m128i*)(p + 0x20));
+    __m128i x4 = _mm_loadu_si128((const __m128i*)(p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)c));
+    p += 64; n -= 64;
+
+    // Fold four 128-bit lanes in parallel, 64 bytes per iteration.
+    __m128i k = _mm_load_si128((const __m128i*)k1k2);
+    while (n >= 64) {
+        x1 = FOLD(x1, k, _mm_loadu_si128((const __m128i*)(p + 0x00)));
+        x2 = FOLD(x2, k, _mm_loadu_si128((const __m128i*)(p + 0x10)));
+        x3 = FOLD(x3, k, _mm_loadu_si128((const __m128i*)(p + 0x20)));
+        x4 = FOLD(x4, k, _mm_loadu_si128((const __m128i*)(p + 0x30)));
+        p += 64; n -= 64;
+    }
+
+    // Reduce the four lanes to one, then fold any remaining 16-byte blocks.
+    k = _mm_load_si128((const __m128i*)k3k4);
+    x1 = FOLD(x1, k, x2);
+    x1 = FOLD(x1, k, x3);
+    x1 = FOLD(x1, k, x4);
+    while (n >= 16) {
+        x1 = FOLD(x1, k, _mm_loadu_si128((const __m128i*)p));
+        p += 16; n -= 16;
+    }
+
+    // 128 -> 64 bits.
+    __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i x2b = _mm_clmulepi64_si128(x1, k, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2b);
+    k = _mm_loadl_epi64((const __m128i*)k5k0);
+    x2b = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask32);
+    x1 = _mm_clmulepi64_si128(x1, k, 0x00);
+    x1 = _mm_xor_si128(x1, x2b);
+
+    // Barrett reduction to 32 bits.
+    k = _mm_load_si128((const __m128i*)poly);
+    x2b = _mm_and_si128(x1, mask32);
+    x2b = _mm_clmulepi64_si128(x2b, k, 0x10);
+    x2b = _mm_and_si128(x2b, mask32);
+    x2b = _mm_clmulepi64_si128(x2b, k, 0x00);
+    x1 = _mm_xor_si128(x1, x2b);
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+#undef FOLD
+
+static uint32_t update_pclmul(uint32_t c, const uint8_t* p, size_t n) {
+    if (n >= 64) {
+        size_t bulk = n & ~(size_t)15;
+        c = fold_pclmul(c, p, bulk);
+        p += bulk; n -= bulk;
+    }
+    return update_slice16(c, p, n);
+}
+
+static int cpu_has_pclmul(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+}
+#endif
+
+static uint32_t crc32c_update_slice8(uint32_t c, const uint8_t* p, size_t n) {
+#ifdef CRC32_HAVE_SLICING
+    while (n >= 8) {
+        uint32_t lo = load32(p) ^ c, hi = load32(p + 4);
+        c = crc32c_tab[7][lo & 0xFF] ^ crc32c_tab[6][(lo >> 8) & 0xFF] ^
+            crc32c_tab[5][(lo >> 16) & 0xFF] ^ crc32c_tab[4][lo >> 24] ^
+            crc32c_tab[3][hi & 0xFF] ^ crc32c_tab[2][(hi >> 8) & 0xFF] ^
+            crc32c_tab[1][(hi >> 16) & 0xFF] ^ crc32c_tab[0][hi >> 24];
+        p += 8; n -= 8;
+    }
+#endif
+    for (size_t i = 0; i < n; i++) c = crc32c_tab[0][(c ^ p[i]) & 0xFF] ^ (c >> 8);
+    return c;
+}
+
+#ifdef CRC32C_HAVE_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_update_hw(uint32_t c, const uint8_t* p, size_t n) {
+    uint64_t c64 = c;
+    while (n >= 8) {
+        uint64_t v; memcpy(&v, p, sizeof(v));
+        c64 = _mm_crc32_u64(c64, v);
+        p += 8; n -= 8;
+    }
+    c = (uint32_t)c64;
+    while (n--) c = _mm_crc32_u8(c, *p++);
+    return c;
+}
+
+// Three independent blocks per pass: the CRC32 instruction has a latency of
+// three cycles but issues every cycle, so one stream leaves it two-thirds idle.
+__attribute__((target("sse4.2")))
+static void crc32c_blocks3_hw(const uint8_t* p, size_t block_size, uint32_t* out) {
+    const uint8_t *a = p, *b = p + block_size, *d = p + 2 * block_size;
+    uint64_t ca = 0xFFFFFFFFu, cb = 0xFFFFFFFFu, cd = 0xFFFFFFFFu;
+    size_t i = 0;
+    for (; i + 8 <= block_size; i += 8) {
+        uint64_t va, vb, vd;
+        memcpy(&va, a + i, 8); memcpy(&vb, b + i, 8); memcpy(&vd, d + i, 8);
+        ca = _mm_crc32_u64(ca, va);
+        cb = _mm_crc32_u64(cb, vb);
+        cd = _mm_crc32_u64(cd, vd);
+    }
+    out[0] = crc32c_update_hw((uint32_t)ca, a + i, block_size - i) ^ 0xFFFFFFFFu;
+    out[1] = crc32c_update_hw((uint32_t)cb, b + i, block_size - i) ^ 0xFFFFFFFFu;
+    out[2] = crc32c_update_hw((uint32_t)cd, d + i, block_size - i) ^ 0xFFFFFFFFu;
+}
+
+static int cpu_has_sse42(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+}
+#endif
+
+void crc32_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int j = 0; j < 8; j++) c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+        crc32_tab[0][i] = c;
+    }
+    for (int k = 1; k < 16; k++)
+        for (uint32_t i = 0; i < 256; i++)
+            crc32_tab[k][i] = (crc32_tab[k - 1][i] >> 8) ^ crc32_tab[0][crc32_tab[k - 1][i] & 0xFF];
+
+    crc32_impl = update_slice16;
+    crc32_impl_name = "slice16";
+#ifdef CRC32_HAVE_PCLMUL
+    if (cpu_has_pclmul()) {
+        crc32_impl = update_pclmul;
+        crc32_impl_name = "pclmul";
+    }
+#endif
+#ifndef CRC32_HAVE_SLICING
+    crc32_impl = update_bytewise;
+    crc32_impl_name = "bytewise";
+#endif
+
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int j = 0; j < 8; j++) c = (c & 1) ? (0x82F63B78u ^ (c >> 1)) : (c >> 1);
+        crc32c_tab[0][i] = c;
+    }
+    for (int k = 1; k < 8; k++)
+        for (uint32_t i = 0; i < 256; i++)
+            crc32c_tab[k][i] = (crc32c_tab[k - 1][i] >> 8) ^ crc32c_tab[0][crc32c_tab[k - 1][i] & 0xFF];
+#ifdef CRC32C_HAVE_SSE42
+    crc32c_hw = cpu_has_sse42();
+#endif
+}
+
+const char* crc32_engine(void) {
+    return crc32_impl_name;
+}
+
+uint32_t crc32_update(uint32_t crc, const void* data, size_t n) {
+    return crc32_impl(crc ^ 0xFFFFFFFFu, (const uint8_t*)data, n) ^ 0xFFFFFFFFu;
+}
+
+uint32_t crc32(const void* data, size_t n) {
+    return crc32_update(0, data, n);
+}
+
+uint32_t crc32_bytewise(const void* data, size_t n) {
+    return update_bytewise(0xFFFFFFFFu, (const uint8_t*)data, n) ^ 0xFFFFFFFFu;
+}
+
+uint32_t crc32_slice8(const void* data, size_t n) {
+    return update_slice8(0xFFFFFFFFu, (const uint8_t*)data, n) ^ 0xFFFFFFFFu;
+}
+
+uint32_t crc32_slice16(const void* data, size_t n) {
+    return update_slice16(0xFFFFFFFFu, (const uint8_t*)data, n) ^ 0xFFFFFFFFu;
+}
+
+uint32_t crc32_pclmul(const void* data, size_t n) {
+#ifdef CRC32_HAVE_PCLMUL
+    if (cpu_has_pclmul())
+        return update_pclmul(0xFFFFFFFFu, (const uint8_t*)data, n) ^ 0xFFFFFFFFu;
+#endif
+    return crc32_slice16(data, n);
+}
+
+uint32_t crc32c(const void* data, size_t n) {
+#ifdef CRC32C_HAVE_SSE42
+    if (crc32c_hw) return crc32c_update_hw(0xFFFFFFFFu, (const uint8_t*)data, n) ^ 0xFFFFFFFFu;
+#endif
+    return crc32c_update_slice8(0xFFFFFFFFu, (const uint8_t*)data, n) ^ 0xFFFFFFFFu;
+}
+
+void crc32c_blocks(const void* data, size_t nblocks, size_t block_size, uint32_t* out) {
+    const uint8_t* p = (const uint8_t*)data;
+    size_t i = 0;
+#ifdef CRC32C_HAVE_SSE42
+    if (crc32c_hw)
+        for (; i + 3 <= nblocks; i += 3) crc32c_blocks3_hw(p + i * block_size, block_size, out + i);
+#endif
+    for (; i < nblocks; i++) out[i] = crc32c(p + i * block_size, block_size);
+}
+
+const char* crc32c_engine(void) {
+    return crc32c_hw ? "sse4.2" : "slice8";
+}
+
+uint32_t crc32c_slice8(const void* data, size_t n) {
+    return crc32c_update_slice8(0xFFFFFFFFu, (const uint8_t*)data, n) ^ 0xFFFFFFFFu;
+}
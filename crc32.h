@@ -0,0 +1,41 @@
+// CRC32 (IEEE 802.3, reflected polynomial 0xEDB88320) shared by all MiniVSFS tools,
+// and CRC32C for data block checksums.
+#ifndef MINIVSFS_CRC32_H
+#define MINIVSFS_CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Builds the lookup tables and picks the fastest engine the CPU supports.
+// Must be called once before crc32()/crc32_update().
+void crc32_init(void);
+
+// crc32(data, n) == crc32_update(0, data, n). crc32_update() continues a
+// checksum over data that arrives in pieces.
+uint32_t crc32(const void* data, size_t n);
+uint32_t crc32_update(uint32_t crc, const void* data, size_t n);
+
+// Name of the engine selected by crc32_init(): "pclmul", "slice16" or "slice8".
+const char* crc32_engine(void);
+
+// Individual engines, exposed for benchmarking. All return the same value as
+// crc32(). crc32_pclmul() falls back to slice-by-16 when the CPU lacks
+// PCLMULQDQ/SSE4.1 or the build is not x86-64.
+uint32_t crc32_bytewise(const void* data, size_t n);
+uint32_t crc32_slice8(const void* data, size_t n);
+uint32_t crc32_slice16(const void* data, size_t n);
+uint32_t crc32_pclmul(const void* data, size_t n);
+
+// CRC32C (Castagnoli, reflected polynomial 0x82F63B78), used for per-block
+// data checksums. On x86-64 CPUs with SSE4.2 it runs on the CRC32 instruction,
+// otherwise on slice-by-8 tables; crc32_init() picks the engine.
+uint32_t crc32c(const void* data, size_t n);
+// CRC32C of each of `nblocks` consecutive blocks of `block_size` bytes into
+// out[0..nblocks). With SSE4.2 three blocks are computed in an interleaved
+// stream, which hides the instruction's latency and runs near memory speed.
+void crc32c_blocks(const void* data, size_t nblocks, size_t block_size, uint32_t* out);
+// "sse4.2" or "slice8".
+const char* crc32c_engine(void);
+uint32_t crc32c_slice8(const void* data, size_t n);
+
+#endif
@@ -0,0 +1,166 @@
+// Build: gcc -O2 -std=c17 -Wall -Wextra crc_bench.c crc32.c -o crc_bench
+// Compares the CRC32 engines in crc32.c against the original byte-at-a-time
+// table loop, first checking that every engine is bit-identical to it, then
+// does the same for the CRC32C engines used for data block checksums.
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "crc32.h"
+
+// The loop every tool used before crc32.c existed, kept verbatim as the reference.
+static uint32_t REF_TAB[256];
+static void ref_init(void){
+    for (uint32_t i=0;i<256;i++){
+        uint32_t c=i;
+        for(int j=0;j<8;j++) c = (c&1)?(0xEDB88320u^(c>>1)):(c>>1);
+        REF_TAB[i]=c;
+    }
+}
+static uint32_t ref_crc32(const void* data, size_t n){
+    const uint8_t* p=(const uint8_t*)data; uint32_t c=0xFFFFFFFFu;
+    for(size_t i=0;i<n;i++) c = REF_TAB[(c^p[i])&0xFF] ^ (c>>8);
+    return c ^ 0xFFFFFFFFu;
+}
+
+// Bitwise CRC32C, the reference for the table and SSE4.2 engines.
+static uint32_t ref_crc32c(const void* data, size_t n) {
+    const uint8_t* p = (const uint8_t*)data; uint32_t c = 0xFFFFFFFFu;
+    for (size_t i = 0; i < n; i++) {
+        c ^= p[i];
+        for (int j = 0; j < 8; j++) c = (c & 1) ? (0x82F63B78u ^ (c >> 1)) : (c >> 1);
+    }
+    return c ^ 0xFFFFFFFFu;
+}
+
+typedef struct {
+    const char* name;
+    uint32_t (*fn)(const void*, size_t);
+} engine_t;
+
+static const engine_t engines[] = {
+    { "reference", ref_crc32 },
+    { "bytewise",  crc32_bytewise },
+    { "slice8",    crc32_slice8 },
+    { "slice16",   crc32_slice16 },
+    { "pclmul",    crc32_pclmul },
+    { "crc32()",   crc32 },
+};
+#define NENGINES (sizeof(engines) / sizeof(engines[0]))
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(void) {
+    ref_init();
+    crc32_init();
+
+    const size_t max_len = 1u << 20;
+    uint8_t* buf = malloc(max_len + 16);
+    if (!buf) { perror("malloc"); return 1; }
+    srand(12345);
+    for (size_t i = 0; i < max_len + 16; i++) buf[i] = (uint8_t)rand();
+
+    // Correctness: every length up to 1 KiB at every alignment, plus large sizes.
+    for (size_t align = 0; align < 16; align++) {
+        for (size_t len = 0; len <= 1024; len++) {
+            uint32_t want = ref_crc32(buf + align, len);
+            for (size_t e = 1; e < NENGINES; e++) {
+                if (engines[e].fn(buf + align, len) != want) {
+                    fprintf(stderr, "MISMATCH: %s len=%zu align=%zu\n", engines[e].name, len, align);
+                    return 1;
+                }
+            }
+            uint32_t split = crc32_update(crc32_update(0, buf + align, len / 3), buf + align + len / 3, len - len / 3);
+            if (split != want) {
+                fprintf(stderr, "MISMATCH: crc32_update len=%zu align=%zu\n", len, align);
+                return 1;
+            }
+        }
+    }
+    for (size_t e = 1; e < NENGINES; e++) {
+        if (engines[e].fn(buf, max_len) != ref_crc32(buf, max_len)) {
+            fprintf(stderr, "MISMATCH: %s len=%zu\n", engines[e].name, max_len);
+            return 1;
+        }
+    }
+    printf("all engines match the reference (selected engine: %s)\n\n", crc32_engine());
+
+    // Throughput at the sizes the tools use: inode (120), superblock (4092), 1 MiB.
+    const size_t sizes[] = { 120, 4092, max_len };
+    printf("%-10s %12s %12s %12s   (MiB/s)\n", "engine", "120 B", "4092 B", "1 MiB");
+    for (size_t e = 0; e < NENGINES; e++) {
+        printf("%-10s", engines[e].name);
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            size_t len = sizes[s];
+            size_t iters = (256u << 20) / len;
+            volatile uint32_t sink = 0;
+            double t0 = now_sec();
+            for (size_t i = 0; i < iters; i++) sink ^= engines[e].fn(buf, len);
+            double dt = now_sec() - t0;
+            (void)sink;
+            printf(" %12.0f", (double)iters * len / dt / (1 << 20));
+        }
+        printf("\n");
+    }
+
+    // CRC32C: the check value, every length up to 1 KiB at every alignment,
+    // and the block-batch entry point against one call per block.
+    if (crc32c("123456789", 9) != 0xE3069283u) {
+        fprintf(stderr, "MISMATCH: crc32c check value\n");
+        return 1;
+    }
+    for (size_t align = 0; align < 16; align++) {
+        for (size_t len = 0; len <= 1024; len++) {
+            uint32_t want = ref_crc32c(buf + align, len);
+            if (crc32c(buf + align, len) != want || crc32c_slice8(buf + align, len) != want) {
+                fprintf(stderr, "MISMATCH: crc32c len=%zu align=%zu\n", len, align);
+                return 1;
+            }
+        }
+    }
+    const size_t block = 4096, nblocks = max_len / block;
+    uint32_t* sums = malloc(nblocks * sizeof(uint32_t));
+    if (!sums) { perror("malloc"); return 1; }
+    for (size_t n = 0; n <= nblocks; n += n < 8 ? 1 : 61) {
+        crc32c_blocks(buf + 1, n, block, sums);
+        for (size_t i = 0; i < n; i++) {
+            if (sums[i] != ref_crc32c(buf + 1 + i * block, block)) {
+                fprintf(stderr, "MISMATCH: crc32c_blocks n=%zu block=%zu\n", n, i);
+                return 1;
+            }
+        }
+    }
+    printf("\ncrc32c engines match the reference (selected engine: %s)\n", crc32c_engine());
+
+    struct { const char* name; int batch; } cengines[] = {
+        { "slice8", 0 }, { "crc32c()", 0 }, { "blocks", 1 },
+    };
+    printf("%-10s %12s   (MiB/s, 4 KiB blocks)\n", "engine", "1 MiB");
+    for (size_t e = 0; e < sizeof(cengines) / sizeof(cengines[0]); e++) {
+        size_t iters = 256;
+        volatile uint32_t sink = 0;
+        double t0 = now_sec();
+        for (size_t it = 0; it < iters; it++) {
+            if (cengines[e].batch) {
+                crc32c_blocks(buf, nblocks, block, sums);
+                sink ^= sums[0];
+            } else {
+                for (size_t i = 0; i < nblocks; i++)
+                    sink ^= e == 0 ? crc32c_slice8(buf + i * block, block) : crc32c(buf + i * block, block);
+            }
+        }
+        double dt = now_sec() - t0;
+        (void)sink;
+        printf("%-10s %12.0f\n", cengines[e].name, (double)iters * max_len / dt / (1 << 20));
+    }
+    free(sums);
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,1758 @@
+// In-memory image editing: loading, block and inode allocation, directories
+// and adding files. Errors are reported on stderr.
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include "image.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+
+static int file_list_push_dst(file_list_t *list, const char *path, size_t dst) {
+    if (list->count == list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 16;
+        char **p = realloc(list->paths, cap * sizeof(char *));
+        if (!p) return -1;
+        list->paths = p;
+        size_t *d = realloc(list->dst, cap * sizeof(size_t));
+        if (!d) return -1;
+        list->dst = d;
+        list->cap = cap;
+    }
+    list->paths[list->count] = strdup(path);
+    if (!list->paths[list->count]) return -1;
+    list->dst[list->count] = dst;
+    list->count++;
+    return 0;
+}
+
+int file_list_push(file_list_t *list, const char *path) {
+    return file_list_push_dst(list, path, strspn(path, "/"));
+}
+
+void file_list_free(file_list_t *list) {
+    for (size_t i = 0; i < list->count; i++) free(list->paths[i]);
+    free(list->paths);
+    free(list->dst);
+}
+
+typedef struct {
+    char *path;
+    size_t dst;
+} file_entry_t;
+
+static int cmp_entry(const void *a, const void *b) {
+    return strcmp(((const file_entry_t *)a)->path, ((const file_entry_t *)b)->path);
+}
+
+int file_list_sort(file_list_t *list) {
+    file_entry_t *e = malloc(list->count * sizeof(file_entry_t) + 1);
+    if (!e) return -1;
+    for (size_t i = 0; i < list->count; i++) e[i] = (file_entry_t){list->paths[i], list->dst[i]};
+    qsort(e, list->count, sizeof(file_entry_t), cmp_entry);
+    for (size_t i = 0; i < list->count; i++) {
+        list->paths[i] = e[i].path;
+        list->dst[i] = e[i].dst;
+    }
+    free(e);
+    return 0;
+}
+
+int image_timestamp(const char *arg, uint64_t *out, int *fixed) {
+    const char *v = arg ? arg : getenv("SOURCE_DATE_EPOCH");
+    *fixed = v != NULL;
+    if (!v) {
+        *out = (uint64_t)time(NULL);
+        return 0;
+    }
+    char *end;
+    errno = 0;
+    unsigned long long t = strtoull(v, &end, 10);
+    if (errno || end == v || *end != '\0' || v[0] == '-') {
+        fprintf(stderr, "Invalid source date epoch '%s'.\n", v);
+        return -1;
+    }
+    *out = t;
+    return 0;
+}
+
+// Queues every regular file under dirpath, in name order, descending into
+// subdirectories (but not through symlinks to them). Each subdirectory is
+// queued on `dirs`, when given, before anything inside it. Image paths start
+// `root` characters in, after the directory the walk started from.
+static int collect_dir_at(file_list_t *list, file_list_t *dirs, const char *dirpath, size_t root) {
+    DIR *d = opendir(dirpath);
+    if (!d) {
+        perror("Failed to open directory");
+        return -1;
+    }
+    file_list_t names = {0};
+    struct dirent *ent;
+    int rc = 0;
+    while ((ent = readdir(d)) != NULL) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+        if (file_list_push(&names, ent->d_name) != 0) {
+            rc = -1;
+            break;
+        }
+    }
+    closedir(d);
+    if (rc == 0) rc = file_list_sort(&names);
+    for (size_t i = 0; i < names.count && rc == 0; i++) {
+        char path[4096];
+        struct stat st;
+        if (snprintf(path, sizeof(path), "%s/%s", dirpath, names.paths[i]) >= (int)sizeof(path)) continue;
+        if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            if (dirs) rc = file_list_push_dst(dirs, path, root);
+            if (rc == 0) rc = collect_dir_at(list, dirs, path, root);
+        }
+        else if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) rc = file_list_push_dst(list, path, root);
+    }
+    file_list_free(&names);
+    return rc;
+}
+
+int collect_dir(file_list_t *list, file_list_t *dirs, const char *dirpath) {
+    return collect_dir_at(list, dirs, dirpath, strlen(dirpath));
+}
+
+// Queues one path per line; blank lines are ignored.
+int collect_manifest(file_list_t *list, const char *manifest) {
+    FILE *f = strcmp(manifest, "-") ? fopen(manifest, "r") : stdin;
+    if (!f) {
+        perror("Failed to open manifest");
+        return -1;
+    }
+    char line[4096];
+    int rc = 0;
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0') continue;
+        if (file_list_push(list, line) != 0) {
+            rc = -1;
+            break;
+        }
+    }
+    if (f != stdin) fclose(f);
+    return rc;
+}
+
+static int write_all(int fd, const uint8_t *src, uint64_t len, uint64_t off) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, src, len, (off_t)off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        src += n;
+        len -= (uint64_t)n;
+        off += (uint64_t)n;
+    }
+    return 0;
+}
+
+// Writes back only the dirty blocks, coalescing adjacent ones into one pwrite.
+static int write_dirty(const image_t *img, int fd) {
+    uint64_t b = 0;
+    while (b < img->total_blocks) {
+        if (!block_dirty(img, b)) {
+            b++;
+            continue;
+        }
+        uint64_t run = b;
+        while (run < img->total_blocks && block_dirty(img, run)) run++;
+        if (write_all(fd, img->base + b * img->bs, (run - b) * img->bs, b * img->bs) != 0) {
+            perror("Failed to update image");
+            return -1;
+        }
+        b = run;
+    }
+    return 0;
+}
+
+// Points the view at the metadata of the image at img->base. Images written
+// before the free counters existed get them counted here, once; the next
+// store persists them with the superblock.
+static void image_setup(image_t *img) {
+    img->sb = (superblock_t *)img->base;
+    img->inode_bitmap = img->base + img->bs * img->sb->inode_bitmap_start;
+    img->data_bitmap = img->base + img->bs * img->sb->data_bitmap_start;
+    img->inode_table = (inode_t *)(img->base + img->bs * img->sb->inode_table_start);
+    img->refcounts = (img->sb->flags & SB_FLAG_DEDUP)
+        ? (refcount_t *)(img->base + img->bs * sb_ext(img->sb)->refcount_start) : NULL;
+    img->csums = (img->sb->flags & SB_FLAG_DATA_CSUM)
+        ? (uint32_t *)(img->base + img->bs * sb_ext(img->sb)->csum_start) : NULL;
+    // A failed copy only costs logging every block of the batch.
+    img->batch_bitmap = (img->sb->flags & SB_FLAG_JOURNAL) ? malloc((img->sb->data_region_blocks + 7) / 8) : NULL;
+    if (img->batch_bitmap) memcpy(img->batch_bitmap, img->data_bitmap, (img->sb->data_region_blocks + 7) / 8);
+    img->dedup = NULL;
+    img->compress = COMPRESS_NONE;
+    img->timestamp = (uint64_t)time(NULL);
+    img->base_checksum = img->sb->checksum;
+
+    superblock_ext_t *ext = sb_ext(img->sb);
+    if (ext->ext_flags & SB_EXT_FREE_COUNTS) return;
+    bitmap_run_stats_t st;
+    bitmap_free_runs(img->inode_bitmap, img->sb->inode_count, &st);
+    ext->free_inodes = st.free_bits;
+    bitmap_free_runs(img->data_bitmap, img->sb->data_region_blocks, &st);
+    ext->free_blocks = st.free_bits;
+    ext->ext_flags |= SB_EXT_FREE_COUNTS;
+    mark_dirty(img, img->sb, img->bs);
+}
+
+int image_load(image_t *img, const char *path, int writable) {
+    img->fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (img->fd < 0) {
+        perror("Failed to open input image");
+        return -1;
+    }
+
+    superblock_t sb;
+    struct stat st;
+    if (pread(img->fd, &sb, sizeof(sb), 0) != (ssize_t)sizeof(sb) || fstat(img->fd, &st) != 0) {
+        fprintf(stderr, "Failed to read superblock.\n");
+        close(img->fd);
+        return -1;
+    }
+
+    if (sb.magic != MVFS_MAGIC || sb.version == 0 || sb.version > MVFS_VERSION || (sb.flags & ~SB_FLAGS_KNOWN) ||
+        !block_size_valid(sb.block_size)) {
+        fprintf(stderr, "Not a MiniVSFS image (or an unsupported version).\n");
+        close(img->fd);
+        return -1;
+    }
+
+    img->bs = sb.block_size;
+    img->total_blocks = sb.total_blocks;
+    img->total_bytes = sb.total_blocks * img->bs;
+    if ((uint64_t)st.st_size < img->total_bytes || img->total_bytes == 0) {
+        fprintf(stderr, "Input image is truncated.\n");
+        close(img->fd);
+        return -1;
+    }
+    img->base = mmap(NULL, img->total_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, img->fd, 0);
+    if (img->base == MAP_FAILED) {
+        perror("mmap");
+        close(img->fd);
+        return -1;
+    }
+    img->dirty = calloc((img->total_blocks + 7) / 8, 1);
+    if (!img->dirty) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        munmap(img->base, img->total_bytes);
+        close(img->fd);
+        return -1;
+    }
+    // Recovery. A writable image gets the pending transaction in place now;
+    // otherwise it stays in the mapping, as modified blocks.
+    if (journal_replay(img->base, img->dirty) > 0 && writable) {
+        if (write_dirty(img, img->fd) != 0 || fdatasync(img->fd) != 0) {
+            perror("Failed to replay the journal");
+            free(img->dirty);
+            munmap(img->base, img->total_bytes);
+            close(img->fd);
+            return -1;
+        }
+        memset(img->dirty, 0, (img->total_blocks + 7) / 8);
+    }
+
+    image_setup(img);
+    return 0;
+}
+
+int image_attach(image_t *img, uint8_t *base, uint64_t total_blocks) {
+    img->fd = -1;
+    img->base = base;
+    img->bs = ((superblock_t *)base)->block_size;
+    img->total_blocks = total_blocks;
+    img->total_bytes = total_blocks * img->bs;
+    img->dirty = calloc((total_blocks + 7) / 8, 1);
+    if (!img->dirty) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        return -1;
+    }
+    image_setup(img);
+    return 0;
+}
+
+// Content index of the file data blocks of a dedup image: hash chains of
+// data-region bits keyed by the block's CRC32. A matching CRC is confirmed by
+// comparing the blocks, so a collision never shares different data.
+typedef struct dedup_index {
+    uint64_t mask;          // bucket count - 1
+    uint32_t *head;         // per bucket: first bit + 1, 0 = empty
+    uint32_t *next;         // per bit: next bit + 1 in its chain
+    uint32_t *crc;          // per bit
+    uint8_t *member;        // bitmap: bit is in the index
+} dedup_index_t;
+
+static void dedup_free(dedup_index_t *dx) {
+    if (!dx) return;
+    free(dx->head);
+    free(dx->next);
+    free(dx->crc);
+    free(dx->member);
+    free(dx);
+}
+
+static void dedup_insert(dedup_index_t *dx, uint64_t bit, uint32_t crc) {
+    uint64_t h = crc & dx->mask;
+    dx->crc[bit] = crc;
+    dx->next[bit] = dx->head[h];
+    dx->head[h] = (uint32_t)bit + 1;
+    bitmap_set(dx->member, bit);
+}
+
+// Drops data-region bit `bit` from the index before its contents change or
+// the block is freed.
+static void dedup_forget(image_t *img, uint64_t bit) {
+    dedup_index_t *dx = img->dedup;
+    if (!dx || !bitmap_test(dx->member, bit)) return;
+    uint32_t *link = &dx->head[dx->crc[bit] & dx->mask];
+    while (*link != bit + 1) link = &dx->next[*link - 1];
+    *link = dx->next[bit];
+    bitmap_clear(dx->member, bit);
+}
+
+void image_close(image_t *img) {
+    if (img->fd >= 0) {
+        munmap(img->base, img->total_bytes);
+        close(img->fd);
+    }
+    free(img->dirty);
+    free(img->batch_bitmap);
+    dedup_free(img->dedup);
+}
+
+// Records that [p, p+len) inside the image has been modified.
+void mark_dirty(image_t *img, const void *p, size_t len) {
+    uint64_t off = (uint64_t)((const uint8_t *)p - img->base);
+    for (uint64_t b = off / img->bs; b <= (off + len - 1) / img->bs; b++)
+        img->dirty[b / 8] |= (uint8_t)(1u << (b % 8));
+}
+
+int block_dirty(const image_t *img, uint64_t b) {
+    return (img->dirty[b / 8] >> (b % 8)) & 1;
+}
+
+// Checksums are computed once per batch, over runs of modified blocks, rather
+// than at every write to a block.
+void image_finalize(image_t *img) {
+    if (img->csums) {
+        const superblock_t *sb = img->sb;
+        for (uint64_t bit = 0; bit < sb->data_region_blocks;) {
+            uint64_t b = sb->data_region_start + bit;
+            if (!block_dirty(img, b) || !bitmap_test(img->data_bitmap, bit)) {
+                bit++;
+                continue;
+            }
+            uint64_t end = bit + 1;
+            while (end < sb->data_region_blocks && block_dirty(img, sb->data_region_start + end) &&
+                   bitmap_test(img->data_bitmap, end))
+                end++;
+            crc32c_blocks(img->base + img->bs * b, end - bit, img->bs, &img->csums[bit]);
+            mark_dirty(img, &img->csums[bit], (end - bit) * sizeof(uint32_t));
+            bit = end;
+        }
+    }
+    if (img->sb->flags & SB_FLAG_JOURNAL) sb_ext(img->sb)->journal_seq++;
+    superblock_crc_finalize(img->sb);
+    mark_dirty(img, img->sb, img->bs);
+}
+
+int image_store(const image_t *img, const char *path) {
+    int out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        perror("Failed to open output image");
+        return -1;
+    }
+    // A reflinked copy of the input shares its unchanged blocks, so only the
+    // dirty ones cost a write.
+    int rc;
+    if (img->fd >= 0 && ioctl(out, FICLONE, img->fd) == 0)
+        rc = ftruncate(out, (off_t)img->total_bytes) == 0 ? write_dirty(img, out) : -1;
+    else
+        rc = write_all(out, img->base, img->total_bytes, 0);
+    if (close(out) != 0) rc = -1;
+    if (rc != 0) perror("Failed to write output image");
+    return rc;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Whether dirty block `b` goes through the journal: everything but the
+// data-region blocks that were free when the batch began, unless the previous
+// transaction (`prev`, `nprev` ascending block numbers) logged them.
+static int journal_logs(const image_t *img, const uint32_t *prev, uint32_t nprev, uint64_t b) {
+    uint64_t start = img->sb->data_region_start;
+    if (!img->batch_bitmap || b < start || bitmap_test(img->batch_bitmap, b - start)) return 1;
+    uint32_t key = (uint32_t)b;
+    return nprev > 0 && bsearch(&key, prev, nprev, sizeof(uint32_t), cmp_u32) != NULL;
+}
+
+// Commits the batch as a journal transaction (see journal_header_t).
+static int store_journaled(image_t *img, int fd) {
+    const superblock_ext_t *ext = sb_ext(img->sb);
+    uint64_t bs = img->bs, cap = journal_capacity(ext->journal_blocks, (uint32_t)bs), n = 0;
+    uint64_t slot = ext->journal_start + (ext->journal_seq % 2) * (ext->journal_blocks / 2);
+    uint64_t other = ext->journal_start + ((ext->journal_seq + 1) % 2) * (ext->journal_blocks / 2);
+    uint8_t *desc = calloc(2, bs);
+    if (!desc) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        return -1;
+    }
+    // The previous transaction, read from the file: a replay after a crash
+    // in this commit may still apply it. Logging too much is harmless, so
+    // its checksum is not verified.
+    const journal_header_t *prev = (const journal_header_t *)(desc + bs);
+    uint32_t nprev = 0;
+    if (pread(fd, desc + bs, bs, (off_t)(other * bs)) == (ssize_t)bs && prev->magic == MVFS_JOURNAL_MAGIC &&
+        prev->seq + 1 == ext->journal_seq && prev->nblocks <= cap)
+        nprev = prev->nblocks;
+    const uint32_t *prev_list = (const uint32_t *)(prev + 1);
+    for (uint64_t b = 0; b < img->total_blocks; b++)
+        n += block_dirty(img, b) && journal_logs(img, prev_list, nprev, b);
+    if (n > cap) {
+        fprintf(stderr, "Journal too small for this update (%llu blocks to log, room for %llu); "
+                        "write a new image with --output instead.\n", (unsigned long long)n, (unsigned long long)cap);
+        free(desc);
+        return -1;
+    }
+    journal_header_t *hdr = (journal_header_t *)desc;
+    uint32_t *list = (uint32_t *)(hdr + 1);
+    // Unlogged runs go to their place and logged ones after the descriptor.
+    int rc = 0;
+    for (uint64_t b = 0; rc == 0 && b < img->total_blocks;) {
+        if (!block_dirty(img, b)) {
+            b++;
+            continue;
+        }
+        int logs = journal_logs(img, prev_list, nprev, b);
+        uint64_t run = b;
+        while (run < img->total_blocks && block_dirty(img, run) &&
+               journal_logs(img, prev_list, nprev, run) == logs)
+            run++;
+        uint64_t off = logs ? (slot + 1 + hdr->nblocks) * bs : b * bs;
+        rc = write_all(fd, img->base + b * bs, (run - b) * bs, off);
+        if (logs)
+            for (uint64_t i = b; i < run; i++) list[hdr->nblocks++] = (uint32_t)i;
+        b = run;
+    }
+    hdr->magic = MVFS_JOURNAL_MAGIC;
+    hdr->seq = ext->journal_seq;
+    uint32_t c = crc32_update(crc32(hdr, offsetof(journal_header_t, checksum)), list,
+                              hdr->nblocks * sizeof(uint32_t));
+    for (uint32_t i = 0; i < hdr->nblocks; i++) c = crc32_update(c, img->base + list[i] * bs, bs);
+    hdr->checksum = c;
+    if (rc == 0) rc = write_all(fd, desc, bs, slot * bs);
+    if (rc == 0 && fdatasync(fd) != 0) rc = -1;
+    // Committed: the logged blocks can go in place.
+    for (uint32_t i = 0; rc == 0 && i < hdr->nblocks;) {
+        uint32_t j = i + 1;
+        while (j < hdr->nblocks && list[j] == list[j - 1] + 1) j++;
+        rc = write_all(fd, img->base + list[i] * bs, (j - i) * bs, list[i] * bs);
+        i = j;
+    }
+    free(desc);
+    if (rc != 0) {
+        perror("Failed to update image");
+        return -1;
+    }
+    if (img->batch_bitmap) memcpy(img->batch_bitmap, img->data_bitmap, (img->sb->data_region_blocks + 7) / 8);
+    return 0;
+}
+
+int image_store_in_place(image_t *img, int fd) {
+    if (img->sb->flags & SB_FLAG_JOURNAL) return store_journaled(img, fd);
+    return write_dirty(img, fd);
+}
+
+int file_copy_range(int in, uint64_t in_off, int out, uint64_t out_off, uint64_t len) {
+    static int use_cfr = 1;
+    while (len > 0 && use_cfr) {
+        loff_t ioff = (loff_t)in_off, ooff = (loff_t)out_off;
+        ssize_t n = copy_file_range(in, &ioff, out, &ooff, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+            use_cfr = 0;
+            break;
+        }
+        if (n <= 0) return -1;
+        in_off += (uint64_t)n;
+        out_off += (uint64_t)n;
+        len -= (uint64_t)n;
+    }
+    uint8_t buf[64 * 1024];
+    while (len > 0) {
+        ssize_t n = pread(in, buf, len < sizeof(buf) ? len : sizeof(buf), (off_t)in_off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || write_all(out, buf, (uint64_t)n, out_off) != 0) return -1;
+        in_off += (uint64_t)n;
+        out_off += (uint64_t)n;
+        len -= (uint64_t)n;
+    }
+    return 0;
+}
+
+// Delta layout: header block, map, then the stored blocks in image order.
+int image_store_delta(const image_t *img, const char *path) {
+    delta_header_t hdr = {
+        .magic = MVFS_DELTA_MAGIC,
+        .version = MVFS_DELTA_VERSION,
+        .total_blocks = img->total_blocks,
+        .map_blocks = delta_map_blocks(img->total_blocks, img->bs),
+        .base_checksum = img->base_checksum,
+        .result_checksum = img->sb->checksum,
+    };
+    uint8_t *head = calloc(1 + hdr.map_blocks, img->bs);
+    if (!head) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        return -1;
+    }
+    uint8_t *map = head + img->bs;
+    memcpy(map, img->dirty, (img->total_blocks + 7) / 8);
+    for (uint64_t b = 0; b < img->total_blocks; b++) hdr.block_count += bitmap_test(map, b);
+    hdr.checksum = crc32_update(crc32(&hdr, offsetof(delta_header_t, checksum)), map, hdr.map_blocks * img->bs);
+    memcpy(head, &hdr, sizeof(hdr));
+
+    int out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        perror("Failed to open output delta");
+        free(head);
+        return -1;
+    }
+    int rc = write_all(out, head, (1 + hdr.map_blocks) * img->bs, 0);
+    uint64_t off = (1 + hdr.map_blocks) * img->bs;
+    for (uint64_t b = 0; rc == 0 && b < img->total_blocks;) {
+        if (!bitmap_test(map, b)) {
+            b++;
+            continue;
+        }
+        uint64_t run = b;
+        while (run < img->total_blocks && bitmap_test(map, run)) run++;
+        rc = write_all(out, img->base + b * img->bs, (run - b) * img->bs, off);
+        off += (run - b) * img->bs;
+        b = run;
+    }
+    if (close(out) != 0) rc = -1;
+    if (rc != 0) perror("Failed to write output delta");
+    free(head);
+    return rc;
+}
+
+int delta_open(const char *path, uint32_t bs, delta_header_t *hdr, uint8_t **map) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    *map = NULL;
+    if (pread(fd, hdr, sizeof(*hdr), 0) != (ssize_t)sizeof(*hdr) || hdr->magic != MVFS_DELTA_MAGIC ||
+        hdr->version != MVFS_DELTA_VERSION || hdr->total_blocks == 0 ||
+        hdr->map_blocks != delta_map_blocks(hdr->total_blocks, bs)) {
+        fprintf(stderr, "%s: not a MiniVSFS delta.\n", path);
+        close(fd);
+        return -1;
+    }
+    *map = malloc(hdr->map_blocks * bs);
+    if (!*map) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        close(fd);
+        return -1;
+    }
+    if (pread(fd, *map, hdr->map_blocks * bs, bs) != (ssize_t)(hdr->map_blocks * bs) ||
+        crc32_update(crc32(hdr, offsetof(delta_header_t, checksum)), *map, hdr->map_blocks * bs) != hdr->checksum) {
+        fprintf(stderr, "%s: delta header is damaged.\n", path);
+        free(*map);
+        *map = NULL;
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int image_apply_delta(image_t *img, const char *path, int mark) {
+    delta_header_t hdr;
+    uint8_t *map;
+    int fd = delta_open(path, img->bs, &hdr, &map);
+    if (fd < 0) return -1;
+    int rc = -1;
+    if (hdr.total_blocks != img->total_blocks || hdr.base_checksum != img->base_checksum) {
+        fprintf(stderr, "%s: delta was not made against this image.\n", path);
+        goto out;
+    }
+    uint64_t off = (1 + hdr.map_blocks) * img->bs;
+    for (uint64_t b = 0; b < img->total_blocks;) {
+        if (!bitmap_test(map, b)) {
+            b++;
+            continue;
+        }
+        uint64_t run = b;
+        while (run < img->total_blocks && bitmap_test(map, run)) run++;
+        uint64_t len = (run - b) * img->bs;
+        for (uint64_t done = 0; done < len;) {
+            ssize_t n = pread(fd, img->base + b * img->bs + done, len - done, (off_t)(off + done));
+            if (n <= 0) {
+                fprintf(stderr, "%s: delta is truncated.\n", path);
+                goto out;
+            }
+            done += (uint64_t)n;
+        }
+        if (mark) mark_dirty(img, img->base + b * img->bs, len);
+        off += len;
+        b = run;
+    }
+    img->base_checksum = hdr.result_checksum;
+    rc = 0;
+out:
+    free(map);
+    close(fd);
+    return rc;
+}
+
+// Marks data-region bit `bit` allocated and keeps the free count (and on
+// dedup images its reference count) in step.
+static void take_block(image_t *img, uint64_t bit) {
+    bitmap_set(img->data_bitmap, bit);
+    mark_dirty(img, &img->data_bitmap[bit / 8], 1);
+    sb_ext(img->sb)->free_blocks--;
+    if (img->refcounts) {
+        img->refcounts[bit] = 1;
+        mark_dirty(img, &img->refcounts[bit], sizeof(refcount_t));
+    }
+}
+
+// Allocates one zeroed data block next-fit; returns 0 if the data region is full.
+uint32_t alloc_block(image_t *img) {
+    superblock_ext_t *ext = sb_ext(img->sb);
+    if (ext->free_blocks == 0) return 0;
+    uint64_t bit = bitmap_find_free(img->data_bitmap, img->sb->data_region_blocks, ext->data_alloc_hint);
+    if (bit == BITMAP_NONE) return 0;
+    take_block(img, bit);
+    ext->data_alloc_hint = bit + 1;
+    uint32_t blk = (uint32_t)(img->sb->data_region_start + bit);
+    memset(img->base + img->bs * blk, 0, img->bs);
+    mark_dirty(img, img->base + img->bs * blk, img->bs);
+    return blk;
+}
+
+void free_block(image_t *img, uint32_t blk) {
+    uint64_t bit = blk - img->sb->data_region_start;
+    if (img->refcounts) {
+        mark_dirty(img, &img->refcounts[bit], sizeof(refcount_t));
+        if (img->refcounts[bit] > 1) {
+            img->refcounts[bit]--;
+            return;
+        }
+        img->refcounts[bit] = 0;
+        dedup_forget(img, bit);
+    }
+    bitmap_clear(img->data_bitmap, bit);
+    mark_dirty(img, &img->data_bitmap[bit / 8], 1);
+    sb_ext(img->sb)->free_blocks++;
+}
+
+static dirent64_t *dir_entry(image_t *img, const inode_t *dir, uint64_t slot) {
+    return (dirent64_t *)dir_slot(img->base, dir, slot);
+}
+
+static int dir_indexed(const image_t *img, const inode_t *dir) {
+    return (img->sb->flags & SB_FLAG_DIR_INDEX) && dir->xattr_ptr != 0;
+}
+
+// First free slot of an indexed directory at or after the header's hint, or
+// UINT64_MAX. The hint moves past the used slots it skipped.
+static uint64_t dx_free_slot(image_t *img, const inode_t *dir) {
+    dx_entry_t *tab = dx_table(img->base, dir);
+    uint64_t slots = dir->size_bytes / sizeof(dirent64_t);
+    uint64_t i = tab[0].slot;
+    while (i < slots) {
+        const dirent64_t *de = dir_entry(img, dir, i);
+        if (!de || de->inode_no == 0) break;
+        i++;
+    }
+    if (i != tab[0].slot) {
+        tab[0].slot = (uint32_t)i;
+        mark_dirty(img, &tab[0], sizeof(dx_entry_t));
+    }
+    return i < slots ? i : UINT64_MAX;
+}
+
+// Adds `name` at `slot` to the index of `dir`, first doubling the table when
+// it is 3/4 full. If no contiguous run is free for the bigger table, the index
+// is dropped and the directory falls back to linear scans.
+static void dx_add(image_t *img, inode_t *dir, const char *name, uint64_t slot) {
+    if (!dir_indexed(img, dir)) return;
+    if (dx_needs_grow(img->base, dir)) {
+        uint32_t old_start = dx_start(dir), old_blocks = dx_blocks(dir);
+        uint32_t nblocks = old_blocks * 2;
+        uint64_t bit = nblocks <= DX_MAX_BLOCKS
+            ? bitmap_find_run(img->data_bitmap, img->sb->data_region_blocks, nblocks, sb_ext(img->sb)->data_alloc_hint)
+            : BITMAP_NONE;
+        for (uint32_t b = 0; b < old_blocks; b++) free_block(img, old_start + b);
+        if (bit == BITMAP_NONE) {
+            dir->xattr_ptr = 0;
+            return;
+        }
+        for (uint32_t b = 0; b < nblocks; b++) take_block(img, bit + b);
+        uint32_t start = (uint32_t)(img->sb->data_region_start + bit);
+        // dx_build() skips the new entry: its dirent is already filled in.
+        dx_build(img->base, dir, start, nblocks);
+        mark_dirty(img, img->base + img->bs * start, (size_t)nblocks * img->bs);
+        return;
+    }
+    uint64_t i = dx_insert(img->base, dir, name, slot);
+    dx_entry_t *tab = dx_table(img->base, dir);
+    mark_dirty(img, &tab[0], sizeof(dx_entry_t));
+    mark_dirty(img, &tab[i], sizeof(dx_entry_t));
+}
+
+// Looks `name` up in `dir`, through its hash index when it has one and
+// otherwise by scanning every block, and returns its slot or UINT64_MAX. When
+// `free_slot` is given it receives the first reusable slot (inode_no == 0),
+// or UINT64_MAX if none.
+static uint64_t dir_find_slot(image_t *img, const inode_t *dir, const char *name, uint64_t *free_slot) {
+    if (dir_indexed(img, dir)) {
+        uint64_t slot = dx_lookup(img->base, dir, name);
+        if (free_slot) *free_slot = dx_free_slot(img, dir);
+        return slot == DX_NONE ? UINT64_MAX : slot;
+    }
+    uint64_t slots = dir->size_bytes / sizeof(dirent64_t);
+    if (free_slot) *free_slot = UINT64_MAX;
+    for (uint64_t i = 0; i < slots; i++) {
+        dirent64_t *de = dir_entry(img, dir, i);
+        if (!de) break;
+        if (de->inode_no == 0) {
+            if (free_slot && *free_slot == UINT64_MAX) *free_slot = i;
+            continue;
+        }
+        if (strncmp(de->name, name, sizeof(de->name)) == 0) return i;
+    }
+    return UINT64_MAX;
+}
+
+dirent64_t *dir_find(image_t *img, const inode_t *dir, const char *name, uint64_t *free_slot) {
+    uint64_t slot = dir_find_slot(img, dir, name, free_slot);
+    return slot == UINT64_MAX ? NULL : dir_entry(img, dir, slot);
+}
+
+// Links `blk` at file block `index` of `ino`, with the pointer/extent blocks
+// inode_append_needs() asked for in `spare`.
+static void inode_append(image_t *img, inode_t *ino, uint64_t index, uint32_t blk, const uint32_t *spare) {
+    uint32_t modified = inode_append_block(img->base, ino, index, blk, spare);
+    if (modified) mark_dirty(img, img->base + img->bs * modified, img->bs);
+    // Images from before indirect blocks are upgraded on first use.
+    if (!(ino->flags & INODE_FL_EXTENTS) && ino->indirect && img->sb->version < MVFS_VERSION_INDIRECT)
+        img->sb->version = MVFS_VERSION_INDIRECT;
+}
+
+// Takes `n` blocks into `out`; on failure gives back the ones taken.
+static int alloc_blocks_n(image_t *img, int n, uint32_t *out) {
+    for (int i = 0; i < n; i++) {
+        if ((out[i] = alloc_block(img)) == 0) {
+            fprintf(stderr, "Not enough free data blocks.\n");
+            while (i-- > 0) free_block(img, out[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Maps `blk` at file block `index` (the inode's current block count) of
+// `ino`, allocating any pointer/extent block that takes.
+static int inode_map(image_t *img, inode_t *ino, uint64_t index, uint32_t blk) {
+    int needs = inode_append_needs(img->base, ino, index, blk);
+    uint32_t spare[2] = {0, 0};
+    if (needs < 0) {
+        fprintf(stderr, "Inode cannot map another block.\n");
+        return -1;
+    }
+    if (alloc_blocks_n(img, needs, spare) != 0) return -1;
+    inode_append(img, ino, index, blk, spare);
+    return 0;
+}
+
+uint32_t inode_grow(image_t *img, inode_t *ino, uint64_t index) {
+    // Whether an extent-mapped file needs an extent block depends on the new
+    // block extending the last run, so that block comes first.
+    if (ino->flags & INODE_FL_EXTENTS) {
+        uint32_t blk;
+        if (alloc_blocks_n(img, 1, &blk) != 0) return 0;
+        if (inode_map(img, ino, index, blk) != 0) {
+            free_block(img, blk);
+            return 0;
+        }
+        return blk;
+    }
+    // Block-mapped files take their pointer blocks first, so they sit in front
+    // of the data they map as in inode_set_blocks(): spare[needs] is the data.
+    int needs = inode_append_needs(img->base, ino, index, 0);
+    uint32_t spare[3] = {0, 0, 0};
+    if (needs < 0) {
+        fprintf(stderr, "Inode cannot map another block.\n");
+        return 0;
+    }
+    if (alloc_blocks_n(img, needs + 1, spare) != 0) return 0;
+    inode_append(img, ino, index, spare[needs], spare);
+    return spare[needs];
+}
+
+// Returns a slot for a new entry in `dir`: `free_slot` if one was found,
+// otherwise a new slot at the end, growing the directory by a block when its
+// last block is full. Its number is stored in `*slot_out`. The caller fills
+// the entry, calls dx_add() and finalizes `dir`.
+static dirent64_t *dir_new_slot(image_t *img, inode_t *dir, uint64_t free_slot, uint64_t *slot_out) {
+    if (free_slot != UINT64_MAX) {
+        *slot_out = free_slot;
+        return dir_entry(img, dir, free_slot);
+    }
+
+    uint64_t slot = dir->size_bytes / sizeof(dirent64_t);
+    if (slot % DIRENTS_PER_BLOCK(img->bs) == 0 && slot > 0 && inode_grow(img, dir, slot / DIRENTS_PER_BLOCK(img->bs)) == 0)
+        return NULL;
+    dir->size_bytes += sizeof(dirent64_t);
+    *slot_out = slot;
+    return dir_entry(img, dir, slot);
+}
+
+// Adds an entry for inode `ino_no` to `dir` and finalizes `dir`. Every entry
+// counts as a link of the directory, as the adder has always done for root.
+int dir_link(image_t *img, inode_t *dir, uint64_t free_slot, uint32_t ino_no, uint8_t type, const char *name) {
+    uint64_t slot;
+    dirent64_t *entry = dir_new_slot(img, dir, free_slot, &slot);
+    if (!entry) return -1;
+    memset(entry, 0, sizeof(dirent64_t));
+    entry->inode_no = ino_no;
+    entry->type = type;
+    memcpy(entry->name, name, strnlen(name, sizeof(entry->name) - 1));
+    dirent_checksum_finalize(entry);
+    mark_dirty(img, entry, sizeof(dirent64_t));
+    dx_add(img, dir, entry->name, slot);
+
+    dir->links += 1;
+    inode_crc_finalize(dir);
+    mark_dirty(img, dir, sizeof(inode_t));
+    return 0;
+}
+
+// Allocates an inode number next-fit and marks it used; returns 0 if none is free.
+uint32_t alloc_inode(image_t *img) {
+    superblock_ext_t *ext = sb_ext(img->sb);
+    uint64_t free_ino = ext->free_inodes == 0 ? BITMAP_NONE
+        : bitmap_find_free(img->inode_bitmap, img->sb->inode_count, ext->inode_alloc_hint);
+    if (free_ino == BITMAP_NONE) {
+        fprintf(stderr, "No free inode available.\n");
+        return 0;
+    }
+    bitmap_set(img->inode_bitmap, free_ino);
+    mark_dirty(img, &img->inode_bitmap[free_ino / 8], 1);
+    ext->inode_alloc_hint = free_ino + 1;
+    ext->free_inodes--;
+    return (uint32_t)free_ino + 1;
+}
+
+// Frees every data, pointer and extent block of `ino`.
+static void free_inode_blocks(image_t *img, const inode_t *ino) {
+    if (ino->flags & INODE_FL_INLINE) return;
+    uint64_t nblocks = inode_data_blocks(ino, img->bs);
+    for (uint64_t b = 0; b < nblocks; b++) {
+        uint32_t blk = inode_bmap(img->base, ino, b);
+        if (blk) free_block(img, blk);
+    }
+    if (ino->indirect) free_block(img, ino->indirect);
+    if (!(ino->flags & INODE_FL_EXTENTS) && ino->double_indirect) {
+        const uint32_t *dind = (const uint32_t *)(img->base + (uint64_t)img->bs * ino->double_indirect);
+        for (uint64_t c = 0; c < PTRS_PER_BLOCK(img->bs); c++)
+            if (dind[c]) free_block(img, dind[c]);
+        free_block(img, ino->double_indirect);
+    }
+}
+
+// Undoes alloc_inode(): zeroes inode `ino_no` and marks it free. Its blocks
+// must have been freed already.
+static void release_inode(image_t *img, uint32_t ino_no) {
+    memset(&img->inode_table[ino_no - 1], 0, sizeof(inode_t));
+    mark_dirty(img, &img->inode_table[ino_no - 1], sizeof(inode_t));
+    bitmap_clear(img->inode_bitmap, ino_no - 1);
+    mark_dirty(img, &img->inode_bitmap[(ino_no - 1) / 8], 1);
+    sb_ext(img->sb)->free_inodes++;
+}
+
+// Creates directory `name` in `parent` (inode number `parent_no`), laid out
+// like the builder's root: one block holding "." and "..", plus a one-block
+// index on images with SB_FLAG_DIR_INDEX. Returns the new directory's inode;
+// on failure nothing stays allocated.
+inode_t *make_dir(image_t *img, inode_t *parent, uint32_t parent_no, const char *name, uint64_t free_slot) {
+    uint32_t blk = alloc_block(img), index_blk = 0;
+    if (blk != 0 && (img->sb->flags & SB_FLAG_DIR_INDEX) && (index_blk = alloc_block(img)) == 0) {
+        free_block(img, blk);
+        blk = 0;
+    }
+    if (blk == 0) {
+        fprintf(stderr, "Not enough free data blocks.\n");
+        return NULL;
+    }
+    uint32_t ino_no = alloc_inode(img);
+    if (ino_no == 0) {
+        free_block(img, blk);
+        if (index_blk) free_block(img, index_blk);
+        return NULL;
+    }
+
+    inode_t *dir = &img->inode_table[ino_no - 1];
+    memset(dir, 0, sizeof(inode_t));
+    dir->mode = MODE_DIR;
+    dir->links = 2;      // . and ..
+    dir->size_bytes = 2u * sizeof(dirent64_t);
+    dir->atime = dir->mtime = dir->ctime = img->timestamp;
+    if (img->sb->flags & SB_FLAG_EXTENTS) inode_set_extents(img->base, dir, &blk, 1, 0);
+    else dir->direct[0] = blk;
+
+    dirent64_t *de = (dirent64_t *)(img->base + img->bs * blk);
+    de[0].inode_no = ino_no;
+    de[0].type = DIRENT_DIR;
+    strcpy(de[0].name, ".");
+    dirent_checksum_finalize(&de[0]);
+    de[1].inode_no = parent_no;
+    de[1].type = DIRENT_DIR;
+    strcpy(de[1].name, "..");
+    dirent_checksum_finalize(&de[1]);
+
+    if (index_blk) dx_build(img->base, dir, index_blk, 1);
+    inode_crc_finalize(dir);
+    mark_dirty(img, dir, sizeof(inode_t));
+
+    if (dir_link(img, parent, free_slot, ino_no, DIRENT_DIR, name) != 0) {
+        free_block(img, blk);
+        if (index_blk) free_block(img, index_blk);
+        release_inode(img, ino_no);
+        return NULL;
+    }
+    return dir;
+}
+
+// Removes the entry at `slot` of `dir`, leaving the slot for reuse.
+static void dir_unlink(image_t *img, inode_t *dir, uint64_t slot) {
+    dirent64_t *de = dir_entry(img, dir, slot);
+    if (dir_indexed(img, dir)) {
+        uint64_t i = dx_remove(img->base, dir, de->name, slot);
+        if (i != DX_NONE) {
+            dx_entry_t *tab = dx_table(img->base, dir);
+            mark_dirty(img, &tab[0], sizeof(dx_entry_t));
+            mark_dirty(img, &tab[i], sizeof(dx_entry_t));
+        }
+    }
+    memset(de, 0, sizeof(dirent64_t));
+    mark_dirty(img, de, sizeof(dirent64_t));
+    dir->links -= 1;
+    dir->mtime = dir->ctime = img->timestamp;
+    inode_crc_finalize(dir);
+    mark_dirty(img, dir, sizeof(inode_t));
+}
+
+void unmake_dirs(image_t *img, inode_t *dir, unsigned made) {
+    for (; made > 0; made--) {
+        uint32_t dir_no = (uint32_t)(dir - img->inode_table) + 1;
+        inode_t *parent = &img->inode_table[dir_entry(img, dir, 1)->inode_no - 1];
+        uint64_t slots = parent->size_bytes / sizeof(dirent64_t), slot = 0;
+        while (slot < slots && dir_entry(img, parent, slot)->inode_no != dir_no) slot++;
+        if (slot < slots) dir_unlink(img, parent, slot);
+        if (dir_indexed(img, dir))
+            for (uint32_t b = 0; b < dx_blocks(dir); b++) free_block(img, dx_start(dir) + b);
+        free_inode_blocks(img, dir);
+        release_inode(img, dir_no);
+        dir = parent;
+    }
+}
+
+// Walks the directories leading to `path` inside the image, creating the
+// missing ones if `create` is set, and returns the directory that holds (or
+// will hold) the last component, which is copied to `leaf`. Empty and "."
+// components are skipped; ".." and names longer than 57 bytes are rejected.
+// The number of directories created is stored in `*made`; on failure none
+// are left behind.
+inode_t *resolve_parent(image_t *img, const char *path, char leaf[58], int create, unsigned *made) {
+    char buf[4096];
+    if (snprintf(buf, sizeof(buf), "%s", path) >= (int)sizeof(buf)) {
+        fprintf(stderr, "Path '%s' is too long.\n", path);
+        return NULL;
+    }
+    inode_t *dir = &img->inode_table[ROOT_INO - 1];
+    uint32_t dir_no = ROOT_INO;
+    unsigned n = 0;
+    char *save = NULL, *next;
+    char *comp = strtok_r(buf, "/", &save);
+    while (comp && !strcmp(comp, ".")) comp = strtok_r(NULL, "/", &save);
+    while (comp) {
+        next = strtok_r(NULL, "/", &save);
+        while (next && !strcmp(next, ".")) next = strtok_r(NULL, "/", &save);
+        if (!strcmp(comp, "..")) {
+            fprintf(stderr, "Path '%s' may not contain '..'.\n", path);
+            break;
+        }
+        if (strlen(comp) > 57) {
+            fprintf(stderr, "Name '%s' is longer than 57 bytes.\n", comp);
+            break;
+        }
+        if (!next) {
+            strcpy(leaf, comp);
+            if (made) *made = n;
+            return dir;
+        }
+
+        uint64_t free_slot;
+        dirent64_t *de = dir_find(img, dir, comp, &free_slot);
+        if (de && de->type != DIRENT_DIR) {
+            fprintf(stderr, "Error: '%s' in path '%s' is not a directory.\n", comp, path);
+            break;
+        }
+        if (de) {
+            dir_no = de->inode_no;
+            dir = &img->inode_table[dir_no - 1];
+        } else if (!create) {
+            fprintf(stderr, "Error: '%s' in path '%s' does not exist.\n", comp, path);
+            break;
+        } else {
+            inode_t *child = make_dir(img, dir, dir_no, comp, free_slot);
+            if (!child) break;
+            dir_no = (uint32_t)(child - img->inode_table) + 1;
+            dir = child;
+            n++;
+        }
+        comp = next;
+    }
+    if (!comp) fprintf(stderr, "Path '%s' names no file.\n", path);
+    unmake_dirs(img, dir, n);
+    return NULL;
+}
+
+int image_mkdir(image_t *img, const char *path) {
+    char name[58];
+    unsigned made;
+    inode_t *parent = resolve_parent(img, path, name, 1, &made);
+    if (!parent) return -1;
+    uint64_t free_slot;
+    dirent64_t *de = dir_find(img, parent, name, &free_slot);
+    if (de && de->type != DIRENT_DIR) {
+        fprintf(stderr, "Error: '%s' exists and is not a directory.\n", path);
+        return -1;
+    }
+    if (de) return 0;
+    if (make_dir(img, parent, (uint32_t)(parent - img->inode_table) + 1, name, free_slot)) return 0;
+    unmake_dirs(img, parent, made);
+    return -1;
+}
+
+// A file whose inode, mapping and dirent are in place but whose data blocks
+// have not been filled yet.
+typedef struct {
+    const char *src;
+    uint64_t size;
+    uint32_t ino_no;
+    uint32_t *blocks;   // data blocks in file order
+} file_job_t;
+
+static int inline_eligible(const image_t *img, uint64_t fsize) {
+    return (img->sb->flags & SB_FLAG_INLINE_DATA) && fsize > 0 && fsize <= INODE_INLINE_MAX;
+}
+
+// Stores a file of at most INODE_INLINE_MAX bytes in its inode. The data is
+// read first, so a failed read leaves nothing behind.
+static int inline_file(image_t *img, const char *filename, const char *dst, uint64_t fsize) {
+    uint8_t data[INODE_INLINE_MAX];
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open file to add '%s'.\n", filename);
+        return -1;
+    }
+    for (uint64_t done = 0; done < fsize;) {
+        ssize_t n = pread(fd, data + done, fsize - done, (off_t)done);
+        if (n <= 0) {
+            fprintf(stderr, "Short read from '%s'.\n", filename);
+            close(fd);
+            return -1;
+        }
+        done += (uint64_t)n;
+    }
+    close(fd);
+    uint32_t ino_no = create_file(img, dst);
+    if (ino_no == 0) return -1;
+    inode_t *ino = &img->inode_table[ino_no - 1];
+    ino->flags = INODE_FL_INLINE;
+    memcpy(inode_inline_data(ino), data, fsize);
+    ino->size_bytes = fsize;
+    inode_crc_finalize(ino);
+    mark_dirty(img, ino, sizeof(inode_t));
+    return 0;
+}
+
+// Allocates and links an inode of `fsize` bytes mapping `blocks_needed` data
+// blocks at `dst`, leaving the data to the caller. Only touches metadata.
+static int stage_inode(image_t *img, const char *filename, const char *dst, uint64_t fsize,
+                       uint64_t blocks_needed, file_job_t *job) {
+    superblock_t *sb = img->sb;
+    superblock_ext_t *ext = sb_ext(img->sb);
+    uint8_t *data_bitmap = img->data_bitmap;
+    inode_t *inode_table = img->inode_table;
+
+    if (blocks_needed > INODE_MAX_BLOCKS(img->bs)) {
+        fprintf(stderr, "File '%s' too large for MiniVSFS (max %llu blocks).\n", filename,
+                (unsigned long long)INODE_MAX_BLOCKS(img->bs));
+        return -1;
+    }
+    // Data plus the indirect/double-indirect blocks that map it. Extent-mapped
+    // files need at most one extra block, decided once the runs are known.
+    const int use_extents = (sb->flags & SB_FLAG_EXTENTS) != 0;
+    uint64_t blocks_total = blocks_needed + (use_extents ? 0 : inode_pointer_blocks(blocks_needed, img->bs));
+
+    if (inode_bmap(img->base, &inode_table[ROOT_INO - 1], 0) == 0) {
+        fprintf(stderr, "Root inode has no data block allocated.\n");
+        return -1;
+    }
+
+    // The file is stored at `dst`; missing directories on the way are created.
+    char namebuf[58];
+    inode_t *parent = resolve_parent(img, dst, namebuf, 1, NULL);
+    if (!parent) return -1;
+    uint64_t free_slot;
+    if (dir_find(img, parent, namebuf, &free_slot)) {
+        fprintf(stderr, "Error: '%s' already exists in the image.\n", dst);
+        return -1;
+    }
+
+    // The free count answers "does it fit" without searching the bitmap.
+    if (blocks_total > ext->free_blocks) {
+        fprintf(stderr, "Not enough free data blocks.\n");
+        return -1;
+    }
+
+    // Both searches continue where the previous allocation stopped (next-fit);
+    // the hints are persisted in the superblock for the next run. Everything
+    // that can fail without side effects is checked before the inode and the
+    // blocks are taken, and the later failures give them back.
+    uint64_t *found_bits = malloc(blocks_total * sizeof(uint64_t) + 1);
+    uint32_t *alloc_blocks = malloc(blocks_total * sizeof(uint32_t) + 1);
+    uint32_t *data_blocks = malloc(blocks_needed * sizeof(uint32_t) + 1);
+    if (!found_bits || !alloc_blocks || !data_blocks) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        free(found_bits); free(alloc_blocks); free(data_blocks);
+        return -1;
+    }
+    uint64_t found = bitmap_find_free_n(data_bitmap, sb->data_region_blocks, blocks_total,
+                                        ext->data_alloc_hint, found_bits);
+    if (found < blocks_total) {
+        fprintf(stderr, "Not enough free data blocks.\n");
+        free(found_bits); free(alloc_blocks); free(data_blocks);
+        return -1;
+    }
+
+    for (uint64_t i = 0; i < blocks_total; i++) alloc_blocks[i] = (uint32_t)(sb->data_region_start + found_bits[i]);
+    uint64_t runs = use_extents ? extent_count_runs(alloc_blocks, blocks_needed) : 0;
+    if (runs > INODE_MAX_EXTENTS(img->bs)) {
+        fprintf(stderr, "File '%s' would need %llu extents (max %llu).\n", filename,
+                (unsigned long long)runs, (unsigned long long)INODE_MAX_EXTENTS(img->bs));
+        free(found_bits); free(alloc_blocks); free(data_blocks);
+        return -1;
+    }
+    uint32_t ino_no = alloc_inode(img);
+    if (ino_no == 0) {
+        free(found_bits); free(alloc_blocks); free(data_blocks);
+        return -1;
+    }
+
+    for (uint64_t i = 0; i < blocks_total; i++) {
+        take_block(img, found_bits[i]);
+        mark_dirty(img, img->base + img->bs * alloc_blocks[i], img->bs);
+        ext->data_alloc_hint = found_bits[i] + 1;
+    }
+    free(found_bits);
+
+    inode_t *new_inode = &inode_table[ino_no - 1];
+    memset(new_inode, 0, sizeof(inode_t));
+    new_inode->mode = MODE_FILE;
+    new_inode->links = 1;
+    new_inode->uid = 0;
+    new_inode->gid = 0;
+    new_inode->size_bytes = fsize;
+    new_inode->atime = new_inode->mtime = new_inode->ctime = img->timestamp;
+    if (use_extents) {
+        uint32_t extent_block = 0;
+        if (runs > INODE_EXTENTS && (extent_block = alloc_block(img)) == 0) {
+            fprintf(stderr, "Not enough free data blocks.\n");
+            for (uint64_t i = 0; i < blocks_total; i++) free_block(img, alloc_blocks[i]);
+            release_inode(img, ino_no);
+            free(alloc_blocks); free(data_blocks);
+            return -1;
+        }
+        inode_set_extents(img->base, new_inode, alloc_blocks, blocks_needed, extent_block);
+        memcpy(data_blocks, alloc_blocks, blocks_needed * sizeof(uint32_t));
+    } else {
+        inode_set_blocks(img->base, new_inode, alloc_blocks, blocks_needed, data_blocks);
+    }
+    inode_crc_finalize(new_inode);
+    mark_dirty(img, new_inode, sizeof(inode_t));
+    free(alloc_blocks);
+    // Images from before indirect blocks are upgraded on first use.
+    if (!use_extents && new_inode->indirect && sb->version < MVFS_VERSION_INDIRECT) sb->version = MVFS_VERSION_INDIRECT;
+
+    if (dir_link(img, parent, free_slot, ino_no, DIRENT_FILE, namebuf) != 0) {
+        free_inode_blocks(img, new_inode);
+        release_inode(img, ino_no);
+        free(data_blocks);
+        return -1;
+    }
+    job->src = filename;
+    job->size = fsize;
+    job->ino_no = ino_no;
+    job->blocks = data_blocks;
+    return 0;
+}
+
+// Allocates and links everything `src` needs at `dst`, leaving the data to
+// fill_file(). Only touches metadata, so data of earlier jobs can be read in
+// meanwhile; the exception is a file small enough to be stored inline, which
+// is read and stored right away and leaves `job->blocks` NULL.
+static int stage_file(image_t *img, const char *filename, const char *dst, file_job_t *job) {
+    struct stat st;
+    if (stat(filename, &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Failed to open file to add '%s'.\n", filename);
+        return -1;
+    }
+    uint64_t fsize = (uint64_t)st.st_size;
+    if (inline_eligible(img, fsize)) {
+        job->blocks = NULL;
+        return inline_file(img, filename, dst, fsize);
+    }
+    return stage_inode(img, filename, dst, fsize, (fsize + img->bs - 1) / img->bs, job);
+}
+
+// Reads a staged file into its data blocks, one pread per run of consecutive
+// blocks, and zeroes the tail of the last one. Safe to run concurrently with
+// stage_file() and other fill_file() calls: it only writes the job's blocks,
+// which are already marked dirty.
+static int fill_file(image_t *img, const file_job_t *job) {
+    if (!job->blocks) return 0;
+    int fd = open(job->src, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open file to add '%s'.\n", job->src);
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    uint64_t nblocks = (job->size + img->bs - 1) / img->bs;
+    uint64_t off = 0;
+    for (uint64_t b = 0; b < nblocks;) {
+        uint64_t end = b + 1;
+        while (end < nblocks && job->blocks[end] == job->blocks[end - 1] + 1) end++;
+        uint8_t *dst = img->base + img->bs * job->blocks[b];
+        uint64_t len = (end - b) * img->bs;
+        if (len > job->size - off) len = job->size - off;
+        for (uint64_t done = 0; done < len;) {
+            ssize_t n = pread(fd, dst + done, len - done, (off_t)(off + done));
+            if (n <= 0) {
+                fprintf(stderr, "Short read from '%s'.\n", job->src);
+                close(fd);
+                return -1;
+            }
+            done += (uint64_t)n;
+        }
+        off += len;
+        b = end;
+    }
+    if (job->size % img->bs)
+        memset(img->base + img->bs * job->blocks[nblocks - 1] + job->size % img->bs, 0, img->bs - job->size % img->bs);
+    close(fd);
+    return 0;
+}
+
+// Builds the content index from every data block of every file.
+static dedup_index_t *dedup_index(image_t *img) {
+    if (img->dedup) return img->dedup;
+    uint64_t nbits = img->sb->data_region_blocks, buckets = 1;
+    while (buckets < nbits) buckets <<= 1;
+    dedup_index_t *dx = calloc(1, sizeof(*dx));
+    if (dx) {
+        dx->mask = buckets - 1;
+        dx->head = calloc(buckets, sizeof(uint32_t));
+        dx->next = calloc(nbits, sizeof(uint32_t));
+        dx->crc = calloc(nbits, sizeof(uint32_t));
+        dx->member = calloc((nbits + 7) / 8, 1);
+    }
+    if (!dx || !dx->head || !dx->next || !dx->crc || !dx->member) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        dedup_free(dx);
+        return NULL;
+    }
+    const superblock_t *sb = img->sb;
+    for (uint64_t i = 0; i < sb->inode_count; i++) {
+        const inode_t *ino = &img->inode_table[i];
+        if (!bitmap_test(img->inode_bitmap, i) || (ino->mode & 0170000) != MODE_FILE) continue;
+        uint64_t nblocks = inode_data_blocks(ino, img->bs);
+        for (uint64_t b = 0; b < nblocks; b++) {
+            uint32_t blk = inode_bmap(img->base, ino, b);
+            if (blk < sb->data_region_start || blk >= sb->total_blocks) continue;
+            uint64_t bit = blk - sb->data_region_start;
+            if (!bitmap_test(dx->member, bit)) dedup_insert(dx, bit, crc32(img->base + img->bs * blk, img->bs));
+        }
+    }
+    img->dedup = dx;
+    return dx;
+}
+
+// A block already in the image holding exactly `data`, with a reference to
+// spare, or 0.
+static uint32_t dedup_find(image_t *img, const dedup_index_t *dx, const uint8_t *data, uint32_t crc) {
+    for (uint32_t i = dx->head[crc & dx->mask]; i; i = dx->next[i - 1]) {
+        uint64_t bit = i - 1;
+        uint32_t blk = (uint32_t)(img->sb->data_region_start + bit);
+        if (dx->crc[bit] == crc && img->refcounts[bit] < REFCOUNT_MAX &&
+            memcmp(img->base + img->bs * blk, data, img->bs) == 0)
+            return blk;
+    }
+    return 0;
+}
+
+// add_file() for dedup images. The data has to be read before blocks can be
+// chosen, so this runs on the calling thread: every block is hashed and
+// either shares an identical block (one more reference) or gets a new one.
+static int dedup_file(image_t *img, const char *filename, const char *dst) {
+    dedup_index_t *dx = dedup_index(img);
+    if (!dx) return -1;
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Failed to open file to add '%s'.\n", filename);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    uint64_t fsize = (uint64_t)st.st_size, nblocks = (fsize + img->bs - 1) / img->bs;
+    if (inline_eligible(img, fsize)) {
+        close(fd);
+        return inline_file(img, filename, dst, fsize);
+    }
+    if (nblocks > INODE_MAX_BLOCKS(img->bs)) {
+        fprintf(stderr, "File '%s' too large for MiniVSFS (max %llu blocks).\n", filename,
+                (unsigned long long)INODE_MAX_BLOCKS(img->bs));
+        close(fd);
+        return -1;
+    }
+    uint32_t ino_no = create_file(img, dst);
+    if (ino_no == 0) {
+        close(fd);
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    inode_t *ino = &img->inode_table[ino_no - 1];
+    enum { CHUNK = 256 };
+    uint8_t *buf = malloc((size_t)CHUNK * img->bs);
+    int rc = buf ? 0 : -1;
+    for (uint64_t b = 0; rc == 0 && b < nblocks;) {
+        uint64_t n = nblocks - b < CHUNK ? nblocks - b : CHUNK;
+        uint64_t len = fsize - b * img->bs < n * img->bs ? fsize - b * img->bs : n * img->bs;
+        memset(buf + len, 0, n * img->bs - len);
+        for (uint64_t done = 0; done < len;) {
+            ssize_t r = pread(fd, buf + done, len - done, (off_t)(b * img->bs + done));
+            if (r <= 0) {
+                fprintf(stderr, "Short read from '%s'.\n", filename);
+                rc = -1;
+                break;
+            }
+            done += (uint64_t)r;
+        }
+        for (uint64_t i = 0; rc == 0 && i < n; i++, b++) {
+            const uint8_t *data = buf + i * img->bs;
+            uint32_t crc = crc32(data, img->bs);
+            // The block is mapped before it is referenced, so a failed
+            // mapping has only a fresh block to give back.
+            uint32_t blk = dedup_find(img, dx, data, crc);
+            int shared = blk != 0;
+            if (!shared && (blk = alloc_block(img)) == 0) {
+                fprintf(stderr, "Not enough free data blocks.\n");
+                rc = -1;
+                break;
+            }
+            if (inode_map(img, ino, b, blk) != 0) {
+                if (!shared) free_block(img, blk);
+                rc = -1;
+                break;
+            }
+            uint64_t bit = blk - img->sb->data_region_start;
+            if (shared) {
+                img->refcounts[bit]++;
+                mark_dirty(img, &img->refcounts[bit], sizeof(refcount_t));
+            } else {
+                memcpy(img->base + img->bs * blk, data, img->bs);
+                dedup_insert(dx, bit, crc);
+            }
+            ino->size_bytes = (b + 1) * img->bs < fsize ? (b + 1) * img->bs : fsize;
+        }
+    }
+    if (!buf) fprintf(stderr, "Memory allocation failed.\n");
+    free(buf);
+    close(fd);
+    inode_crc_finalize(ino);
+    mark_dirty(img, ino, sizeof(inode_t));
+    // A half-stored file does not stay linked; removing it also drops the
+    // references and blocks it took.
+    if (rc != 0) remove_file(img, dst);
+    return rc;
+}
+
+// add_file() with img->compress set: each COMPRESS_CHUNK of the file is
+// compressed on its own and the chunk table and chunks are stored as the
+// file's data (see INODE_FL_COMPRESSED). Returns 1, with nothing allocated,
+// when that would not save a block, so the file is stored as is.
+static int compress_file(image_t *img, const char *filename, const char *dst) {
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Failed to open file to add '%s'.\n", filename);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    uint64_t fsize = (uint64_t)st.st_size, nchunks = (fsize + COMPRESS_CHUNK - 1) / COMPRESS_CHUNK;
+    uint64_t table_bytes = (nchunks + 1) * sizeof(uint32_t);
+    // The stream length has to fit the inode's 32 bits; files that large are
+    // left to the plain path and its size checks.
+    if (fsize == 0 || table_bytes + fsize > UINT32_MAX) {
+        close(fd);
+        return 1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    uint8_t *stream = malloc(table_bytes + fsize), *raw = malloc(COMPRESS_CHUNK);
+    if (!stream || !raw) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        free(stream); free(raw);
+        close(fd);
+        return -1;
+    }
+    uint32_t *table = (uint32_t *)stream;
+    uint64_t pos = table_bytes;
+    for (uint64_t c = 0; c < nchunks; c++) {
+        uint64_t len = fsize - c * COMPRESS_CHUNK < COMPRESS_CHUNK ? fsize - c * COMPRESS_CHUNK : COMPRESS_CHUNK;
+        for (uint64_t done = 0; done < len;) {
+            ssize_t r = pread(fd, raw + done, len - done, (off_t)(c * COMPRESS_CHUNK + done));
+            if (r <= 0) {
+                fprintf(stderr, "Short read from '%s'.\n", filename);
+                free(stream); free(raw);
+                close(fd);
+                return -1;
+            }
+            done += (uint64_t)r;
+        }
+        // Anything short of a saving is stored raw.
+        table[c] = (uint32_t)pos;
+        size_t n = chunk_compress(img->compress, raw, len, stream + pos, len - 1);
+        if (n == 0) {
+            memcpy(stream + pos, raw, len);
+            n = len;
+        }
+        pos += n;
+    }
+    table[nchunks] = (uint32_t)pos;
+    free(raw);
+    close(fd);
+
+    uint64_t nblocks = (pos + img->bs - 1) / img->bs;
+    if (nblocks >= (fsize + img->bs - 1) / img->bs) {
+        free(stream);
+        return 1;
+    }
+    file_job_t job;
+    if (stage_inode(img, filename, dst, fsize, nblocks, &job) != 0) {
+        free(stream);
+        return -1;
+    }
+    for (uint64_t b = 0; b < nblocks; b++) {
+        uint8_t *blk = img->base + img->bs * job.blocks[b];
+        uint64_t n = pos - b * img->bs < img->bs ? pos - b * img->bs : img->bs;
+        memcpy(blk, stream + b * img->bs, n);
+        memset(blk + n, 0, img->bs - n);
+    }
+    free(stream);
+    free(job.blocks);
+    inode_t *ino = &img->inode_table[job.ino_no - 1];
+    ino->flags |= INODE_FL_COMPRESSED;
+    ino->xattr_ptr = pos | (uint64_t)img->compress << 32;
+    inode_crc_finalize(ino);
+    mark_dirty(img, ino, sizeof(inode_t));
+    img->sb->flags |= SB_FLAG_COMPRESS;
+    mark_dirty(img, img->sb, img->bs);
+    return 0;
+}
+
+int add_file(image_t *img, const char *filename, const char *dst) {
+    if (img->compress) {
+        int rc = compress_file(img, filename, dst);
+        if (rc <= 0) return rc;
+    }
+    if (img->refcounts) return dedup_file(img, filename, dst);
+    file_job_t job;
+    if (stage_file(img, filename, dst, &job) != 0) return -1;
+    int rc = fill_file(img, &job);
+    free(job.blocks);
+    return rc;
+}
+
+// Ingestion pipeline: the calling thread stages files in list order, which
+// fixes every inode, block and dirent, while reader threads fill the data of
+// the files staged so far. The image is therefore the same for any thread
+// count.
+typedef struct {
+    image_t *img;
+    file_job_t *jobs;
+    size_t staged, next;    // jobs[0..staged) are ready; jobs[next] is the next to read
+    int done, failed;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+} ingest_t;
+
+static void *ingest_reader(void *arg) {
+    ingest_t *in = arg;
+    pthread_mutex_lock(&in->lock);
+    for (;;) {
+        while (in->next == in->staged && !in->done) pthread_cond_wait(&in->ready, &in->lock);
+        if (in->next == in->staged || in->failed) break;
+        size_t i = in->next++;
+        pthread_mutex_unlock(&in->lock);
+        int rc = fill_file(in->img, &in->jobs[i]);
+        pthread_mutex_lock(&in->lock);
+        if (rc != 0) in->failed = 1;
+    }
+    pthread_mutex_unlock(&in->lock);
+    return NULL;
+}
+
+int add_files(image_t *img, const file_list_t *files, long threads) {
+    if (threads <= 1 || files->count <= 1 || img->refcounts || img->compress) {
+        for (size_t i = 0; i < files->count; i++)
+            if (add_file(img, files->paths[i], files->paths[i] + files->dst[i]) != 0) return -1;
+        return 0;
+    }
+
+    ingest_t in = { .img = img };
+    in.jobs = calloc(files->count, sizeof(file_job_t));
+    pthread_t *tids = calloc((size_t)threads, sizeof(pthread_t));
+    if (!in.jobs || !tids) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        free(in.jobs); free(tids);
+        return -1;
+    }
+    pthread_mutex_init(&in.lock, NULL);
+    pthread_cond_init(&in.ready, NULL);
+    long started = 0;
+    while (started < threads && pthread_create(&tids[started], NULL, ingest_reader, &in) == 0) started++;
+
+    int failed = 0;
+    for (size_t i = 0; i < files->count && !failed; i++) {
+        failed = stage_file(img, files->paths[i], files->paths[i] + files->dst[i], &in.jobs[i]) != 0;
+        pthread_mutex_lock(&in.lock);
+        if (failed) in.failed = 1;
+        else in.staged++;
+        failed = in.failed;
+        pthread_cond_signal(&in.ready);
+        pthread_mutex_unlock(&in.lock);
+    }
+    pthread_mutex_lock(&in.lock);
+    in.done = 1;
+    pthread_cond_broadcast(&in.ready);
+    pthread_mutex_unlock(&in.lock);
+    for (long t = 0; t < started; t++) pthread_join(tids[t], NULL);
+
+    // No reader could start: read on this thread instead.
+    for (size_t i = in.next; !in.failed && i < in.staged; i++)
+        if (fill_file(img, &in.jobs[i]) != 0) in.failed = 1;
+
+    for (size_t i = 0; i < in.staged; i++) free(in.jobs[i].blocks);
+    pthread_cond_destroy(&in.ready);
+    pthread_mutex_destroy(&in.lock);
+    free(in.jobs);
+    free(tids);
+    return in.failed ? -1 : 0;
+}
+
+uint32_t create_file(image_t *img, const char *dst) {
+    char name[58];
+    unsigned made;
+    inode_t *parent = resolve_parent(img, dst, name, 1, &made);
+    if (!parent) return 0;
+    uint64_t free_slot;
+    if (dir_find(img, parent, name, &free_slot)) {
+        fprintf(stderr, "Error: '%s' already exists in the image.\n", dst);
+        return 0;
+    }
+    uint32_t ino_no = alloc_inode(img);
+    if (ino_no == 0) {
+        unmake_dirs(img, parent, made);
+        return 0;
+    }
+    inode_t *ino = &img->inode_table[ino_no - 1];
+    memset(ino, 0, sizeof(inode_t));
+    ino->mode = MODE_FILE;
+    ino->links = 1;
+    ino->atime = ino->mtime = ino->ctime = img->timestamp;
+    if (img->sb->flags & SB_FLAG_EXTENTS) ino->flags = INODE_FL_EXTENTS;
+    inode_crc_finalize(ino);
+    mark_dirty(img, ino, sizeof(inode_t));
+    if (dir_link(img, parent, free_slot, ino_no, DIRENT_FILE, name) != 0) {
+        release_inode(img, ino_no);
+        unmake_dirs(img, parent, made);
+        return 0;
+    }
+    return ino_no;
+}
+
+// Before file block `index` (stored in `blk`) of `ino` is modified on a dedup
+// image: a shared block is replaced by a private copy, and a private one
+// leaves the content index. Returns the block to write, or 0.
+static uint32_t unshare_block(image_t *img, inode_t *ino, uint64_t index, uint32_t blk) {
+    uint64_t bit = blk - img->sb->data_region_start;
+    if (img->refcounts[bit] <= 1) {
+        dedup_forget(img, bit);
+        return blk;
+    }
+    uint32_t *slot = inode_block_slot(img->base, ino, index);
+    if (!slot) {
+        fprintf(stderr, "Cannot copy a shared block of an extent-mapped file.\n");
+        return 0;
+    }
+    uint32_t copy = alloc_block(img);
+    if (copy == 0) {
+        fprintf(stderr, "Not enough free data blocks.\n");
+        return 0;
+    }
+    memcpy(img->base + img->bs * copy, img->base + img->bs * blk, img->bs);
+    free_block(img, blk);
+    *slot = copy;
+    mark_dirty(img, slot, sizeof(*slot));
+    return copy;
+}
+
+// Moves the data of an inline inode into a data block, so it can grow.
+static int inode_uninline(image_t *img, inode_t *ino) {
+    uint8_t data[INODE_INLINE_MAX];
+    uint64_t size = ino->size_bytes;
+    memcpy(data, inode_inline_data(ino), INODE_INLINE_MAX);
+    memset(inode_inline_data(ino), 0, INODE_INLINE_MAX);
+    ino->flags = (img->sb->flags & SB_FLAG_EXTENTS) ? INODE_FL_EXTENTS : 0;
+    ino->size_bytes = 0;
+    if (size == 0) return 0;
+    uint32_t blk = inode_grow(img, ino, 0);
+    if (blk == 0) {
+        memcpy(inode_inline_data(ino), data, INODE_INLINE_MAX);
+        ino->flags = INODE_FL_INLINE;
+        ino->size_bytes = size;
+        return -1;
+    }
+    memcpy(img->base + img->bs * blk, data, size);
+    mark_dirty(img, img->base + img->bs * blk, size);
+    ino->size_bytes = size;
+    return 0;
+}
+
+int write_file(image_t *img, uint32_t ino_no, const void *buf, uint64_t len, uint64_t off) {
+    inode_t *ino = &img->inode_table[ino_no - 1];
+    if ((ino->mode & 0170000) != MODE_FILE) {
+        fprintf(stderr, "Inode %u is not a regular file.\n", ino_no);
+        return -1;
+    }
+    if (ino->flags & INODE_FL_COMPRESSED) {
+        fprintf(stderr, "Inode %u is compressed; compressed files are read-only.\n", ino_no);
+        return -1;
+    }
+    uint64_t end = off + len;
+    if (end < off || (end + img->bs - 1) / img->bs > INODE_MAX_BLOCKS(img->bs)) {
+        fprintf(stderr, "Write past the largest MiniVSFS file (%llu blocks).\n",
+                (unsigned long long)INODE_MAX_BLOCKS(img->bs));
+        return -1;
+    }
+
+    // Small files stay in (or, while still empty, move into) the inode.
+    if ((img->sb->flags & SB_FLAG_INLINE_DATA) && ino->size_bytes == 0 && end <= INODE_INLINE_MAX)
+        ino->flags = INODE_FL_INLINE;
+    if ((ino->flags & INODE_FL_INLINE) && end <= INODE_INLINE_MAX) {
+        memcpy(inode_inline_data(ino) + off, buf, len);
+        if (end > ino->size_bytes) ino->size_bytes = end;
+        ino->mtime = ino->ctime = img->timestamp;
+        inode_crc_finalize(ino);
+        mark_dirty(img, ino, sizeof(inode_t));
+        return 0;
+    }
+    if ((ino->flags & INODE_FL_INLINE) && inode_uninline(img, ino) != 0) return -1;
+
+    // New blocks come zeroed, so a write past the end leaves a zero-filled gap.
+    int rc = 0;
+    for (uint64_t b = (ino->size_bytes + img->bs - 1) / img->bs; b < (end + img->bs - 1) / img->bs; b++) {
+        if (inode_grow(img, ino, b) == 0) {
+            rc = -1;
+            break;
+        }
+        ino->size_bytes = (b + 1) * img->bs < end ? (b + 1) * img->bs : end;
+    }
+    if (rc == 0) {
+        const uint8_t *src = buf;
+        for (uint64_t pos = off; rc == 0 && pos < end;) {
+            uint32_t blk = inode_bmap(img->base, ino, pos / img->bs);
+            if (img->refcounts && (blk = unshare_block(img, ino, pos / img->bs, blk)) == 0) {
+                rc = -1;
+                break;
+            }
+            size_t n = img->bs - pos % img->bs;
+            if (n > end - pos) n = (size_t)(end - pos);
+            uint8_t *dst = img->base + (uint64_t)img->bs * blk + pos % img->bs;
+            memcpy(dst, src, n);
+            mark_dirty(img, dst, n);
+            src += n;
+            pos += n;
+        }
+        if (end > ino->size_bytes) ino->size_bytes = end;
+    }
+    ino->mtime = ino->ctime = img->timestamp;
+    inode_crc_finalize(ino);
+    mark_dirty(img, ino, sizeof(inode_t));
+    return rc;
+}
+
+int remove_file(image_t *img, const char *path) {
+    char name[58];
+    inode_t *parent = resolve_parent(img, path, name, 0, NULL);
+    if (!parent) return -1;
+    uint64_t slot = dir_find_slot(img, parent, name, NULL);
+    if (slot == UINT64_MAX) {
+        fprintf(stderr, "Error: '%s' does not exist in the image.\n", path);
+        return -1;
+    }
+    dirent64_t *de = dir_entry(img, parent, slot);
+    if (de->type != DIRENT_FILE) {
+        fprintf(stderr, "Error: '%s' is not a regular file.\n", path);
+        return -1;
+    }
+    uint32_t ino_no = de->inode_no;
+    // The slot is reused by the next entry added to this directory.
+    dir_unlink(img, parent, slot);
+
+    inode_t *ino = &img->inode_table[ino_no - 1];
+    if (ino->links > 1) {
+        ino->links -= 1;
+        ino->ctime = img->timestamp;
+        inode_crc_finalize(ino);
+    } else {
+        free_inode_blocks(img, ino);
+        release_inode(img, ino_no);
+    }
+    mark_dirty(img, ino, sizeof(inode_t));
+    return 0;
+}
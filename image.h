@@ -0,0 +1,154 @@
+// Editing a MiniVSFS image in memory, shared by mkfs_adder and mkfs_builder.
+#ifndef MINIVSFS_IMAGE_H
+#define MINIVSFS_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "minivsfs.h"
+
+// In-memory view of an image. Every file of a batch is added to this view and
+// the result is written out once, so N files cost one image read and one write.
+// The view is a private mapping (or, for image_attach(), the caller's buffer):
+// pages are only read when touched, and nothing reaches the file until
+// image_store()/image_store_in_place() writes it back.
+// Every modified block is recorded in `dirty` so in-place updates can write
+// just those blocks.
+typedef struct {
+    int fd;                 // -1 for an attached buffer
+    uint8_t *base;
+    uint64_t total_bytes;
+    uint64_t total_blocks;
+    uint64_t bs;            // block size, from the superblock; 64-bit so offsets never wrap
+    uint8_t *dirty;         // one bit per image block
+    superblock_t *sb;
+    uint8_t *inode_bitmap;
+    uint8_t *data_bitmap;
+    inode_t *inode_table;
+    refcount_t *refcounts;  // per data-region block, on SB_FLAG_DEDUP images
+    uint32_t *csums;        // per data-region block, on SB_FLAG_DATA_CSUM images
+    uint8_t *batch_bitmap;  // data bitmap as the batch began, on SB_FLAG_JOURNAL images
+    struct dedup_index *dedup;  // content index of file blocks, built on first use
+    unsigned compress;      // COMPRESS_* for files added from now on; COMPRESS_NONE after load
+    uint64_t timestamp;     // atime/mtime/ctime of new inodes
+    uint32_t base_checksum; // superblock checksum as loaded (after any deltas)
+} image_t;
+
+// Host paths, each with the offset of the part that names it inside the
+// image: paths + dst.
+typedef struct {
+    char **paths;
+    size_t *dst;
+    size_t count, cap;
+} file_list_t;
+
+// Queues `path`, stored inside the image at `path` minus its leading '/'.
+int file_list_push(file_list_t *list, const char *path);
+void file_list_free(file_list_t *list);
+// Sorts by host path, keeping each entry's destination.
+int file_list_sort(file_list_t *list);
+
+// Queue the regular files under `dirpath` (and, if `dirs` is given, the
+// subdirectories themselves, parents first), in name order. Their image paths
+// are relative to `dirpath`.
+int collect_dir(file_list_t *files, file_list_t *dirs, const char *dirpath);
+// Queue one path per line of `manifest` ("-" for stdin), stored like
+// file_list_push() stores them.
+int collect_manifest(file_list_t *list, const char *manifest);
+
+// Time to stamp on new inodes and superblocks: `arg` (--source-date-epoch)
+// if given, else $SOURCE_DATE_EPOCH, else the current time. `*fixed` tells
+// whether it came from either, i.e. the caller wants a reproducible image.
+// Returns -1 if the value is not a non-negative integer.
+int image_timestamp(const char *arg, uint64_t *out, int *fixed);
+
+// Maps an image file. With `writable`, img->fd can be passed to
+// image_store_in_place(); the mapping itself is always private. A pending
+// journal transaction is replayed: with `writable` into the file (with one
+// fdatasync), otherwise into the mapping, its blocks counting as modified.
+int image_load(image_t *img, const char *path, int writable);
+// Wraps an image already built in memory at `base` (total_blocks blocks of
+// the superblock's block size).
+// The buffer stays the caller's; image_close() leaves it alone. Both set
+// `timestamp` to the current time.
+int image_attach(image_t *img, uint8_t *base, uint64_t total_blocks);
+void image_close(image_t *img);
+
+// Records that [p, p+len) inside the image has been modified.
+void mark_dirty(image_t *img, const void *p, size_t len);
+// Whether block `b` has been modified since the image was loaded.
+int block_dirty(const image_t *img, uint64_t b);
+// Completes a batch of changes before any store: refreshes the data checksums
+// of the modified blocks, bumps the journal sequence and refreshes the
+// superblock checksum.
+void image_finalize(image_t *img);
+// Writes the whole image to `path`. A loaded image is first cloned from its
+// file (FICLONE) where the filesystem allows, so only dirty blocks are written.
+int image_store(const image_t *img, const char *path);
+// Writes the dirty blocks back to the image file `fd`. On SB_FLAG_JOURNAL
+// images the batch is committed through the journal and is durable on
+// return (one fdatasync); the next batch starts from this one. Fails without
+// touching the image's contents if the journal cannot hold the batch.
+int image_store_in_place(image_t *img, int fd);
+
+// Delta files (see delta_header_t). image_store_delta() writes the dirty
+// blocks as a delta against the image as loaded; finalize the superblock
+// first. image_apply_delta() lays a delta over the loaded image; with
+// `mark` its blocks count as modified, so that a full or in-place store
+// includes them, otherwise they become part of the base for the next delta.
+int image_store_delta(const image_t *img, const char *path);
+int image_apply_delta(image_t *img, const char *path, int mark);
+// Opens delta `path`, made against an image with `bs`-byte blocks, and
+// checks its header and map; returns the descriptor with the map in `*map`
+// (to be freed), or -1.
+int delta_open(const char *path, uint32_t bs, delta_header_t *hdr, uint8_t **map);
+
+// Copies `len` bytes between files with copy_file_range, which reflinks or
+// copies server-side where it can, falling back to pread/pwrite.
+int file_copy_range(int in, uint64_t in_off, int out, uint64_t out_off, uint64_t len);
+
+// Allocation; both return 0 when nothing is free. On dedup images
+// free_block() drops one reference and frees the block with the last one.
+uint32_t alloc_block(image_t *img);
+void free_block(image_t *img, uint32_t blk);
+uint32_t alloc_inode(image_t *img);
+// Maps a new zeroed block at file block `index` (the inode's current block
+// count) of `ino`, with any pointer/extent block that takes. Returns it, or 0.
+// The caller updates size_bytes and finalizes the inode.
+uint32_t inode_grow(image_t *img, inode_t *ino, uint64_t index);
+
+// Directories.
+dirent64_t *dir_find(image_t *img, const inode_t *dir, const char *name, uint64_t *free_slot);
+int dir_link(image_t *img, inode_t *dir, uint64_t free_slot, uint32_t ino_no, uint8_t type, const char *name);
+inode_t *make_dir(image_t *img, inode_t *parent, uint32_t parent_no, const char *name, uint64_t free_slot);
+inode_t *resolve_parent(image_t *img, const char *path, char leaf[58], int create, unsigned *made);
+// Removes the `made` directories resolve_parent() created, `dir` and the
+// ones above it, when what was to go inside them failed.
+void unmake_dirs(image_t *img, inode_t *dir, unsigned made);
+// Creates directory `path` and any missing parents; succeeds if it exists.
+int image_mkdir(image_t *img, const char *path);
+
+// Creates an empty regular file at `dst` (and any missing directories on the
+// way); returns its inode number, or 0 with no new directory left behind.
+uint32_t create_file(image_t *img, const char *dst);
+// Writes `len` bytes at `off` of file `ino_no`, growing it as needed. If the
+// image runs out of blocks the file may be left longer, zero-filled.
+// Compressed files are refused.
+int write_file(image_t *img, uint32_t ino_no, const void *buf, uint64_t len, uint64_t off);
+// Removes the entry for regular file `path`; when it was the last link, the
+// inode and all its blocks are freed.
+int remove_file(image_t *img, const char *path);
+
+// Stores host file `src` at `dst` inside the image. On SB_FLAG_DEDUP images
+// each block identical to one already stored is shared instead of copied.
+// With img->compress set the file is stored compressed if that saves a block
+// (compressed files are not deduplicated).
+int add_file(image_t *img, const char *src, const char *dst);
+// Stores every file of `files`, in list order, at its image path. With more
+// than one thread the source files are read in parallel while the next ones
+// are allocated; the result does not depend on the thread count. A failure
+// leaves the files and directories added before it in the image, which the
+// tools then do not write.
+int add_files(image_t *img, const file_list_t *files, long threads);
+
+#endif
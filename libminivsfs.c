@@ -0,0 +1,184 @@
+// libminivsfs handle API, a thin layer over image.c.
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include "libminivsfs.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "minivsfs.h"
+#include "bitmap.h"
+#include "image.h"
+
+struct mvfs {
+    image_t img;
+    int writable;
+    // Last chunk decompressed from a compressed file, so sequential small
+    // reads decompress each chunk once.
+    uint8_t *chunk, *scratch;
+    uint32_t chunk_ino;     // 0 = none
+    uint64_t chunk_index;
+    int chunk_len;
+};
+
+// Inode `ino` if it is allocated, else NULL.
+static inode_t *get_inode(mvfs_t *fs, uint32_t ino) {
+    if (ino == 0 || ino > fs->img.sb->inode_count || !bitmap_test(fs->img.inode_bitmap, ino - 1)) {
+        fprintf(stderr, "Inode %u is not allocated.\n", ino);
+        return NULL;
+    }
+    return &fs->img.inode_table[ino - 1];
+}
+
+static int check_writable(const mvfs_t *fs) {
+    if (fs->writable) return 0;
+    fprintf(stderr, "Image is open read-only.\n");
+    return -1;
+}
+
+mvfs_t *mvfs_open(const char *path, int flags) {
+    crc32_init();
+    mvfs_t *fs = calloc(1, sizeof(*fs));
+    if (!fs) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        return NULL;
+    }
+    fs->writable = flags == MVFS_RDWR;
+    if (image_load(&fs->img, path, fs->writable) != 0) {
+        free(fs);
+        return NULL;
+    }
+    int fixed;
+    if (image_timestamp(NULL, &fs->img.timestamp, &fixed) != 0) {
+        mvfs_close(fs);
+        return NULL;
+    }
+    return fs;
+}
+
+void mvfs_close(mvfs_t *fs) {
+    if (!fs) return;
+    image_close(&fs->img);
+    free(fs->chunk);
+    free(fs->scratch);
+    free(fs);
+}
+
+int mvfs_sync(mvfs_t *fs) {
+    if (check_writable(fs) != 0) return -1;
+    image_t *img = &fs->img;
+    image_finalize(img);
+    if (image_store_in_place(img, img->fd) != 0) return -1;
+    // A journaled store is durable already.
+    if (!(img->sb->flags & SB_FLAG_JOURNAL) && fdatasync(img->fd) != 0) {
+        perror("fdatasync");
+        return -1;
+    }
+    memset(img->dirty, 0, (img->total_blocks + 7) / 8);
+    return 0;
+}
+
+uint32_t mvfs_lookup(mvfs_t *fs, const char *path) {
+    uint32_t ino = path_lookup(fs->img.base, path);
+    if (ino && !bitmap_test(fs->img.inode_bitmap, ino - 1)) return 0;
+    return ino;
+}
+
+int mvfs_stat(mvfs_t *fs, uint32_t ino, mvfs_stat_t *st) {
+    const inode_t *in = get_inode(fs, ino);
+    if (!in) return -1;
+    st->ino = ino;
+    st->mode = in->mode;
+    st->links = in->links;
+    st->size = in->size_bytes;
+    st->mtime = in->mtime;
+    return 0;
+}
+
+uint32_t mvfs_create(mvfs_t *fs, const char *path) {
+    if (check_writable(fs) != 0) return 0;
+    return create_file(&fs->img, path);
+}
+
+int mvfs_write(mvfs_t *fs, uint32_t ino, const void *buf, uint64_t len, uint64_t off) {
+    if (check_writable(fs) != 0 || !get_inode(fs, ino)) return -1;
+    return write_file(&fs->img, ino, buf, len, off);
+}
+
+static ssize_t read_compressed(mvfs_t *fs, uint32_t ino, const inode_t *in, uint8_t *dst, uint64_t len,
+                               uint64_t off) {
+    if (!fs->chunk) fs->chunk = malloc(COMPRESS_CHUNK);
+    if (!fs->scratch) fs->scratch = malloc(COMPRESS_CHUNK);
+    if (!fs->chunk || !fs->scratch) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        return -1;
+    }
+    for (uint64_t pos = off; pos < off + len;) {
+        uint64_t c = pos / COMPRESS_CHUNK;
+        if (fs->chunk_ino != ino || fs->chunk_index != c) {
+            fs->chunk_ino = 0;
+            fs->chunk_len = compressed_chunk(fs->img.base, in, c, fs->chunk, fs->scratch);
+            if (fs->chunk_len < 0) {
+                fprintf(stderr, "Inode %u: compressed chunk %llu is damaged or uses an unsupported algorithm.\n",
+                        ino, (unsigned long long)c);
+                return -1;
+            }
+            fs->chunk_ino = ino;
+            fs->chunk_index = c;
+        }
+        uint64_t n = (uint64_t)fs->chunk_len - pos % COMPRESS_CHUNK;
+        if (n > off + len - pos) n = off + len - pos;
+        memcpy(dst, fs->chunk + pos % COMPRESS_CHUNK, n);
+        dst += n;
+        pos += n;
+    }
+    return (ssize_t)len;
+}
+
+ssize_t mvfs_read(mvfs_t *fs, uint32_t ino, void *buf, uint64_t len, uint64_t off) {
+    const inode_t *in = get_inode(fs, ino);
+    if (!in) return -1;
+    if ((in->mode & 0170000) != MODE_FILE) {
+        fprintf(stderr, "Inode %u is not a regular file.\n", ino);
+        return -1;
+    }
+    if (off >= in->size_bytes) return 0;
+    if (len > in->size_bytes - off) len = in->size_bytes - off;
+    if (len > SSIZE_MAX) len = SSIZE_MAX;
+    if (in->flags & INODE_FL_INLINE) {
+        memcpy(buf, inode_inline_data((inode_t *)in) + off, len);
+        return (ssize_t)len;
+    }
+    if (in->flags & INODE_FL_COMPRESSED) return read_compressed(fs, ino, in, buf, len, off);
+    const superblock_t *sb = fs->img.sb;
+    uint64_t bs = fs->img.bs;
+    uint8_t *dst = buf;
+    for (uint64_t pos = off; pos < off + len;) {
+        uint32_t blk = inode_bmap(fs->img.base, in, pos / bs);
+        if (blk < sb->data_region_start || blk >= sb->total_blocks) {
+            fprintf(stderr, "Inode %u: block %llu is not mapped.\n", ino, (unsigned long long)(pos / bs));
+            return -1;
+        }
+        // Blocks written since the load get their checksums at the next sync.
+        uint32_t bad;
+        if (!block_dirty(&fs->img, blk) && data_csum_check(fs->img.base, blk, 1, &bad) != 0) {
+            fprintf(stderr, "Inode %u: block %u fails its data checksum.\n", ino, bad);
+            return -1;
+        }
+        size_t n = bs - pos % bs;
+        if (n > off + len - pos) n = (size_t)(off + len - pos);
+        memcpy(dst, fs->img.base + bs * blk + pos % bs, n);
+        dst += n;
+        pos += n;
+    }
+    return (ssize_t)len;
+}
+
+int mvfs_unlink(mvfs_t *fs, const char *path) {
+    if (check_writable(fs) != 0) return -1;
+    fs->chunk_ino = 0;
+    return remove_file(&fs->img, path);
+}
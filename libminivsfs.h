@@ -0,0 +1,56 @@
+// libminivsfs: keep a MiniVSFS image open and operate on it in place.
+//
+// A handle maps the image once; the superblock, bitmaps, inode table and
+// every block touched stay cached in memory across calls. Changes are kept
+// in the handle until mvfs_sync() writes the modified blocks back, so a crash
+// or an mvfs_close() without a sync leaves the image file as it was.
+// Errors are reported on stderr and through the return value.
+#ifndef LIBMINIVSFS_H
+#define LIBMINIVSFS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define MVFS_API __attribute__((visibility("default")))
+
+typedef struct mvfs mvfs_t;
+
+#define MVFS_RDONLY 0
+#define MVFS_RDWR   1
+
+typedef struct {
+    uint32_t ino;
+    uint16_t mode;          // MODE_FILE or MODE_DIR plus permission bits
+    uint16_t links;
+    uint64_t size;
+    uint64_t mtime;
+} mvfs_stat_t;
+
+// Opens `path` with MVFS_RDONLY or MVFS_RDWR; NULL on failure, also when
+// SOURCE_DATE_EPOCH is set but not a valid timestamp.
+MVFS_API mvfs_t *mvfs_open(const char *path, int flags);
+// Releases the handle, dropping changes not yet synced.
+MVFS_API void mvfs_close(mvfs_t *fs);
+// Writes every block changed since the last sync back to the image file and
+// flushes it to disk. On images built with a journal, a crash during a sync
+// leaves a journal that the next open replays, giving the image as of this
+// sync if its commit reached the disk and as of the previous one otherwise.
+MVFS_API int mvfs_sync(mvfs_t *fs);
+
+// Inode number of `path` (relative to the root), or 0 if it does not exist.
+MVFS_API uint32_t mvfs_lookup(mvfs_t *fs, const char *path);
+MVFS_API int mvfs_stat(mvfs_t *fs, uint32_t ino, mvfs_stat_t *st);
+
+// Creates an empty regular file, and any missing parent directories; returns
+// its inode number, or 0, in which case no directory it created is kept.
+MVFS_API uint32_t mvfs_create(mvfs_t *fs, const char *path);
+// Writes `len` bytes at offset `off` of file `ino`, extending it as needed.
+// Files stored compressed (mkfs_adder --compress) are read-only.
+MVFS_API int mvfs_write(mvfs_t *fs, uint32_t ino, const void *buf, uint64_t len, uint64_t off);
+// Reads up to `len` bytes at offset `off`; returns the byte count (0 at end
+// of file) or -1, also when a block fails its data checksum.
+MVFS_API ssize_t mvfs_read(mvfs_t *fs, uint32_t ino, void *buf, uint64_t len, uint64_t off);
+// Removes regular file `path` and frees its inode and blocks.
+MVFS_API int mvfs_unlink(mvfs_t *fs, const char *path);
+
+#endif
@@ -0,0 +1,501 @@
+// Shared MiniVSFS on-disk helpers: checksums, journal replay, data checksums,
+// block and extent mapping, compressed reads, the directory index and path
+// lookup.
+#include "minivsfs.h"
+
+#include <string.h>
+
+// Block 0 up to its last 4 bytes, with the checksum field taken as zero.
+static uint32_t superblock_crc(const superblock_t *sb) {
+    const uint8_t *p = (const uint8_t *)sb;
+    const uint32_t zero = 0;
+    size_t at = offsetof(superblock_t, checksum), after = at + sizeof(zero);
+    uint32_t s = crc32_update(0, p, at);
+    s = crc32_update(s, &zero, sizeof(zero));
+    return crc32_update(s, p + after, sb->block_size - 4 - after);
+}
+
+static uint32_t inode_crc(const inode_t* ino) {
+    uint8_t tmp[INODE_SIZE]; memcpy(tmp, ino, INODE_SIZE);
+    // zero crc area before computing
+    memset(&tmp[120], 0, 8);
+    return crc32(tmp, 120);
+}
+
+static uint8_t dirent_checksum(const dirent64_t* de) {
+    const uint8_t* p = (const uint8_t*)de;
+    uint8_t x = 0;
+    for (int i = 0; i < 63; i++) x ^= p[i];   // covers ino(4) + type(1) + name(58)
+    return x;
+}
+
+uint32_t superblock_crc_finalize(superblock_t *sb) {
+    uint32_t s = superblock_crc(sb);
+    sb->checksum = s;
+    return s;
+}
+
+void inode_crc_finalize(inode_t* ino) {
+    ino->inode_crc = (uint64_t)inode_crc(ino); // low 4 bytes carry the crc
+}
+
+void dirent_checksum_finalize(dirent64_t* de) {
+    de->checksum = dirent_checksum(de);
+}
+
+int superblock_crc_ok(const superblock_t *sb) {
+    return sb->checksum == superblock_crc(sb);
+}
+
+int inode_crc_ok(const inode_t* ino) {
+    return ino->inode_crc == (uint64_t)inode_crc(ino);
+}
+
+int dirent_checksum_ok(const dirent64_t* de) {
+    return de->checksum == dirent_checksum(de);
+}
+
+uint64_t inode_pointer_blocks(uint64_t ndata, uint32_t bs) {
+    uint64_t ptrs = PTRS_PER_BLOCK(bs);
+    if (ndata <= DIRECT_MAX) return 0;
+    ndata -= DIRECT_MAX;
+    if (ndata <= ptrs) return 1;
+    ndata -= ptrs;
+    return 2 + (ndata + ptrs - 1) / ptrs;
+}
+
+// Header of the complete, intact transaction in journal slot `s`, or NULL.
+// Copies the blocks of transaction `t` into place; returns how many changed.
+static uint64_t journal_apply(uint8_t* image, const journal_header_t* t, uint8_t* changed) {
+    // The transaction lives in the journal, which it never logs, so
+    // overwriting the superblock here leaves `t` intact.
+    uint32_t bs = ((const superblock_t*)image)->block_size;
+    const uint32_t* list = (const uint32_t*)(t + 1);
+    const uint8_t* src = (const uint8_t*)t + bs;
+    uint64_t n = 0;
+    for (uint32_t i = 0; i < t->nblocks; i++, src += bs) {
+        uint8_t* dst = image + (uint64_t)list[i] * bs;
+        if (memcmp(dst, src, bs) == 0) continue;
+        memcpy(dst, src, bs);
+        if (changed) changed[list[i] / 8] |= (uint8_t)(1u << (list[i] % 8));
+        n++;
+    }
+    return n;
+}
+
+static const journal_header_t* journal_slot(const uint8_t* image, uint64_t s) {
+    const superblock_t* sb = (const superblock_t*)image;
+    const superblock_ext_t* ext = sb_ext((superblock_t*)sb);
+    uint32_t bs = sb->block_size;
+    uint64_t start = ext->journal_start + s * (ext->journal_blocks / 2);
+    const journal_header_t* hdr = (const journal_header_t*)(image + start * bs);
+    const uint32_t* list = (const uint32_t*)(hdr + 1);
+    if (hdr->magic != MVFS_JOURNAL_MAGIC || hdr->seq % 2 != s ||
+        hdr->nblocks > journal_capacity(ext->journal_blocks, bs))
+        return NULL;
+    uint32_t c = crc32_update(crc32(hdr, offsetof(journal_header_t, checksum)), list,
+                              hdr->nblocks * sizeof(uint32_t));
+    for (uint32_t i = 0; i < hdr->nblocks; i++) {
+        if (list[i] >= sb->total_blocks ||
+            (list[i] >= ext->journal_start && list[i] < ext->journal_start + ext->journal_blocks))
+            return NULL;
+        c = crc32_update(c, image + (start + 1 + i) * bs, bs);
+    }
+    return c == hdr->checksum ? hdr : NULL;
+}
+
+uint64_t journal_replay(uint8_t* image, uint8_t* changed) {
+    superblock_t* sb = (superblock_t*)image;
+    const superblock_ext_t* ext = sb_ext(sb);
+    if (!(sb->flags & SB_FLAG_JOURNAL) || ext->journal_blocks < JOURNAL_MIN_BLOCKS ||
+        ext->journal_start + ext->journal_blocks > sb->total_blocks)
+        return 0;
+    const journal_header_t *a = journal_slot(image, 0), *b = journal_slot(image, 1);
+    if (a && b && a->seq > b->seq) {
+        const journal_header_t* t = a;
+        a = b;
+        b = t;
+    } else if (!a) {
+        a = b;
+        b = NULL;
+    }
+    // Oldest first: a transaction applies if it is the superblock's batch or
+    // the next one, and the newer one after it if it directly follows.
+    uint64_t seq = ext->journal_seq, n = 0;
+    const journal_header_t* prev = NULL;
+    for (const journal_header_t* t = a; t; t = t == a ? b : NULL) {
+        if (prev ? t->seq != prev->seq + 1 : (t->seq != seq && t->seq != seq + 1)) continue;
+        n += journal_apply(image, t, changed);
+        prev = t;
+    }
+    return n;
+}
+
+const uint32_t* data_csums(const uint8_t* image) {
+    const superblock_t* sb = (const superblock_t*)image;
+    if (!(sb->flags & SB_FLAG_DATA_CSUM)) return NULL;
+    return (const uint32_t*)(image + sb_ext((superblock_t*)sb)->csum_start * sb->block_size);
+}
+
+int data_csum_check(const uint8_t* image, uint32_t blk, uint64_t n, uint32_t* bad) {
+    const uint32_t* csums = data_csums(image);
+    if (!csums) return 0;
+    const superblock_t* sb = (const superblock_t*)image;
+    uint32_t sums[64];
+    while (n > 0) {
+        size_t chunk = n < 64 ? (size_t)n : 64;
+        crc32c_blocks(image + (uint64_t)blk * sb->block_size, chunk, sb->block_size, sums);
+        for (size_t i = 0; i < chunk; i++) {
+            if (sums[i] != csums[blk + i - sb->data_region_start]) {
+                *bad = blk + (uint32_t)i;
+                return -1;
+            }
+        }
+        blk += (uint32_t)chunk;
+        n -= chunk;
+    }
+    return 0;
+}
+
+static const uint32_t* pointer_block(const uint8_t* image, uint32_t blk) {
+    const superblock_t* sb = (const superblock_t*)image;
+    if (blk < sb->data_region_start || blk >= sb->total_blocks) return NULL;
+    return (const uint32_t*)(image + (uint64_t)blk * sb->block_size);
+}
+
+const extent_t* inode_extent(const uint8_t* image, const inode_t* ino, uint64_t i) {
+    if (i < INODE_EXTENTS) return (const extent_t*)ino->direct + i;
+    i -= INODE_EXTENTS;
+    if (i >= EXTENTS_PER_BLOCK(image_bs(image))) return NULL;
+    const extent_t* more = (const extent_t*)pointer_block(image, ino->indirect);
+    return more ? more + i : NULL;
+}
+
+uint32_t* inode_block_slot(uint8_t* image, inode_t* ino, uint64_t index) {
+    if (ino->flags & (INODE_FL_EXTENTS | INODE_FL_INLINE)) return NULL;
+    if (index < DIRECT_MAX) return &ino->direct[index];
+    uint64_t ptrs = PTRS_PER_BLOCK(image_bs(image));
+    index -= DIRECT_MAX;
+    if (index < ptrs) {
+        uint32_t* l1 = (uint32_t*)pointer_block(image, ino->indirect);
+        return l1 ? &l1[index] : NULL;
+    }
+    index -= ptrs;
+    if (index >= ptrs * ptrs) return NULL;
+    const uint32_t* dind = pointer_block(image, ino->double_indirect);
+    if (!dind) return NULL;
+    uint32_t* l2 = (uint32_t*)pointer_block(image, dind[index / ptrs]);
+    return l2 ? &l2[index % ptrs] : NULL;
+}
+
+uint32_t inode_bmap(const uint8_t* image, const inode_t* ino, uint64_t index) {
+    if (ino->flags & INODE_FL_INLINE) return 0;
+    if (ino->flags & INODE_FL_EXTENTS) {
+        uint64_t first = 0;
+        for (uint64_t i = 0; ; i++) {
+            const extent_t* e = inode_extent(image, ino, i);
+            if (!e || e->len == 0) return 0;
+            if (index < first + e->len) return e->start + (uint32_t)(index - first);
+            first += e->len;
+        }
+    }
+    // The lookup does not write; the casts only let both share one walk.
+    const uint32_t* slot = inode_block_slot((uint8_t*)image, (inode_t*)ino, index);
+    return slot ? *slot : 0;
+}
+
+static uint32_t* new_pointer_block(uint8_t* image, uint32_t blk) {
+    uint32_t bs = image_bs(image);
+    uint32_t* p = (uint32_t*)(image + (uint64_t)blk * bs);
+    memset(p, 0, bs);
+    return p;
+}
+
+void inode_set_blocks(uint8_t* image, inode_t* ino, const uint32_t* blocks, uint64_t ndata, uint32_t* data_out) {
+    uint32_t *l1 = NULL, *dind = NULL, *l2 = NULL;
+    uint64_t next = 0, ptrs = PTRS_PER_BLOCK(image_bs(image));
+    memset(ino->direct, 0, sizeof(ino->direct));
+    ino->indirect = ino->double_indirect = 0;
+    for (uint64_t i = 0; i < ndata; i++) {
+        uint32_t* slot;
+        if (i < DIRECT_MAX) {
+            slot = &ino->direct[i];
+        } else if (i - DIRECT_MAX < ptrs) {
+            if (i == DIRECT_MAX) {
+                ino->indirect = blocks[next++];
+                l1 = new_pointer_block(image, ino->indirect);
+            }
+            slot = &l1[i - DIRECT_MAX];
+        } else {
+            uint64_t j = i - DIRECT_MAX - ptrs;
+            if (j == 0) {
+                ino->double_indirect = blocks[next++];
+                dind = new_pointer_block(image, ino->double_indirect);
+            }
+            if (j % ptrs == 0) {
+                dind[j / ptrs] = blocks[next++];
+                l2 = new_pointer_block(image, dind[j / ptrs]);
+            }
+            slot = &l2[j % ptrs];
+        }
+        *slot = blocks[next++];
+        data_out[i] = *slot;
+    }
+}
+
+// Copies bytes [off, off+len) of the data `ino` maps into `dst`, verifying
+// each block's checksum where the image has them.
+static int stored_read(const uint8_t* image, const inode_t* ino, uint64_t off, uint64_t len, uint8_t* dst) {
+    const superblock_t* sb = (const superblock_t*)image;
+    uint32_t bs = sb->block_size;
+    while (len > 0) {
+        uint32_t blk = inode_bmap(image, ino, off / bs), bad;
+        if (blk < sb->data_region_start || blk >= sb->total_blocks || data_csum_check(image, blk, 1, &bad) != 0)
+            return -1;
+        uint64_t n = bs - off % bs;
+        if (n > len) n = len;
+        memcpy(dst, image + (uint64_t)blk * bs + off % bs, n);
+        dst += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int compressed_chunk(const uint8_t* image, const inode_t* ino, uint64_t chunk, uint8_t* out, uint8_t* scratch) {
+    uint64_t nchunks = (ino->size_bytes + COMPRESS_CHUNK - 1) / COMPRESS_CHUNK;
+    uint64_t table_bytes = (nchunks + 1) * sizeof(uint32_t), stored = inode_stored_bytes(ino);
+    uint32_t range[2];
+    if (chunk >= nchunks || table_bytes > stored ||
+        stored_read(image, ino, chunk * sizeof(uint32_t), sizeof(range), (uint8_t*)range) != 0)
+        return -1;
+    uint64_t raw = ino->size_bytes - chunk * COMPRESS_CHUNK;
+    if (raw > COMPRESS_CHUNK) raw = COMPRESS_CHUNK;
+    if (range[0] < table_bytes || range[0] > range[1] || range[1] > stored || range[1] - range[0] > raw)
+        return -1;
+    uint64_t len = range[1] - range[0];
+    if (len == raw) return stored_read(image, ino, range[0], len, out) == 0 ? (int)raw : -1;
+    if (stored_read(image, ino, range[0], len, scratch) != 0 ||
+        chunk_decompress(inode_compress_alg(ino), scratch, len, out, raw) != 0)
+        return -1;
+    return (int)raw;
+}
+
+uint64_t extent_count_runs(const uint32_t* blocks, uint64_t n) {
+    uint64_t runs = 0;
+    for (uint64_t i = 0; i < n; i++)
+        if (i == 0 || blocks[i] != blocks[i - 1] + 1) runs++;
+    return runs;
+}
+
+void inode_set_extents(uint8_t* image, inode_t* ino, const uint32_t* blocks, uint64_t n, uint32_t extent_block) {
+    memset(ino->direct, 0, sizeof(ino->direct));
+    ino->indirect = extent_block;
+    ino->double_indirect = 0;
+    ino->flags |= INODE_FL_EXTENTS;
+    extent_t* more = extent_block ? (extent_t*)new_pointer_block(image, extent_block) : NULL;
+    uint64_t e = 0;
+    for (uint64_t i = 0; i < n; i++) {
+        if (i > 0 && blocks[i] == blocks[i - 1] + 1) {
+            extent_t* cur = e - 1 < INODE_EXTENTS ? (extent_t*)ino->direct + (e - 1) : more + (e - 1 - INODE_EXTENTS);
+            cur->len++;
+            continue;
+        }
+        extent_t* next = e < INODE_EXTENTS ? (extent_t*)ino->direct + e : more + (e - INODE_EXTENTS);
+        next->start = blocks[i];
+        next->len = 1;
+        e++;
+    }
+}
+
+// Number of extents in use and a pointer to the last one (NULL if none).
+static uint64_t last_extent(const uint8_t* image, const inode_t* ino, const extent_t** last) {
+    uint64_t n = 0, max = INODE_MAX_EXTENTS(image_bs(image));
+    *last = NULL;
+    for (const extent_t* e; n < max && (e = inode_extent(image, ino, n)) && e->len; n++) *last = e;
+    return n;
+}
+
+int inode_append_needs(const uint8_t* image, const inode_t* ino, uint64_t index, uint32_t blk) {
+    if (ino->flags & INODE_FL_EXTENTS) {
+        const extent_t* last;
+        uint64_t n = last_extent(image, ino, &last);
+        if (last && last->start + last->len == blk) return 0;
+        if (n >= INODE_MAX_EXTENTS(image_bs(image))) return -1;
+        return (n == INODE_EXTENTS && !ino->indirect) ? 1 : 0;
+    }
+    uint32_t bs = image_bs(image);
+    if (index >= INODE_MAX_BLOCKS(bs)) return -1;
+    return (int)(inode_pointer_blocks(index + 1, bs) - inode_pointer_blocks(index, bs));
+}
+
+uint32_t inode_append_block(uint8_t* image, inode_t* ino, uint64_t index, uint32_t blk, const uint32_t* spare) {
+    if (ino->flags & INODE_FL_EXTENTS) {
+        const extent_t* last;
+        uint64_t n = last_extent(image, ino, &last);
+        if (last && last->start + last->len == blk) {
+            ((extent_t*)last)->len++;
+            return n > INODE_EXTENTS ? ino->indirect : 0;
+        }
+        if (n == INODE_EXTENTS && !ino->indirect) {
+            ino->indirect = spare[0];
+            new_pointer_block(image, ino->indirect);
+        }
+        extent_t* e = (extent_t*)inode_extent(image, ino, n);
+        e->start = blk;
+        e->len = 1;
+        return n >= INODE_EXTENTS ? ino->indirect : 0;
+    }
+    if (index < DIRECT_MAX) {
+        ino->direct[index] = blk;
+        return 0;
+    }
+    uint32_t bs = image_bs(image);
+    uint64_t ptrs = PTRS_PER_BLOCK(bs);
+    index -= DIRECT_MAX;
+    if (index < ptrs) {
+        if (index == 0) {
+            ino->indirect = spare[0];
+            new_pointer_block(image, ino->indirect);
+        }
+        ((uint32_t*)(image + (uint64_t)ino->indirect * bs))[index] = blk;
+        return index == 0 ? 0 : ino->indirect;
+    }
+    index -= ptrs;
+    uint32_t modified = 0;
+    int used = 0;
+    if (index == 0) {
+        ino->double_indirect = spare[used++];
+        new_pointer_block(image, ino->double_indirect);
+    }
+    uint32_t* dind = (uint32_t*)(image + (uint64_t)ino->double_indirect * bs);
+    if (index % ptrs == 0) {
+        dind[index / ptrs] = spare[used++];
+        new_pointer_block(image, dind[index / ptrs]);
+        if (index != 0) modified = ino->double_indirect;
+    } else {
+        modified = dind[index / ptrs];
+    }
+    ((uint32_t*)(image + (uint64_t)dind[index / ptrs] * bs))[index % ptrs] = blk;
+    return modified;
+}
+
+const dirent64_t* dir_slot(const uint8_t* image, const inode_t* dir, uint64_t slot) {
+    uint32_t bs = image_bs(image);
+    uint32_t blk = inode_bmap(image, dir, slot / DIRENTS_PER_BLOCK(bs));
+    if (blk == 0) return NULL;
+    return (const dirent64_t*)(image + (uint64_t)blk * bs) + slot % DIRENTS_PER_BLOCK(bs);
+}
+
+uint32_t dirent_hash(const char* name) {
+    size_t max = sizeof(((dirent64_t*)0)->name);
+    const char* end = memchr(name, '\0', max);
+    return crc32(name, end ? (size_t)(end - name) : max);
+}
+
+static uint64_t dx_slots(const uint8_t* image, const inode_t* dir) {
+    return (uint64_t)dx_blocks(dir) * DX_ENTRIES_PER_BLOCK(image_bs(image));
+}
+
+uint64_t dx_lookup(const uint8_t* image, const inode_t* dir, const char* name) {
+    const dx_entry_t* tab = (const dx_entry_t*)(image + (uint64_t)dx_start(dir) * image_bs(image));
+    uint64_t mask = dx_slots(image, dir) - 1;
+    uint32_t h = dirent_hash(name);
+    for (uint64_t n = 0, i = h & mask; n <= mask; n++, i = (i + 1) & mask) {
+        if (i == 0) continue;
+        if (tab[i].slot == 0) return DX_NONE;
+        if (tab[i].slot == DX_TOMBSTONE || tab[i].hash != h) continue;
+        const dirent64_t* de = dir_slot(image, dir, tab[i].slot - 1);
+        if (de && de->inode_no != 0 && strncmp(de->name, name, sizeof(de->name)) == 0)
+            return tab[i].slot - 1;
+    }
+    return DX_NONE;
+}
+
+int dx_needs_grow(uint8_t* image, const inode_t* dir) {
+    return ((uint64_t)dx_table(image, dir)[0].hash + 2) * 4 > dx_slots(image, dir) * 3;
+}
+
+uint64_t dx_insert(uint8_t* image, const inode_t* dir, const char* name, uint64_t slot) {
+    dx_entry_t* tab = dx_table(image, dir);
+    uint64_t mask = dx_slots(image, dir) - 1;
+    uint32_t h = dirent_hash(name);
+    uint64_t i = h & mask;
+    while (i == 0 || (tab[i].slot != 0 && tab[i].slot != DX_TOMBSTONE)) i = (i + 1) & mask;
+    if (tab[i].slot == 0) tab[0].hash++;
+    tab[i].hash = h;
+    tab[i].slot = (uint32_t)(slot + 1);
+    return i;
+}
+
+uint64_t dx_remove(uint8_t* image, const inode_t* dir, const char* name, uint64_t slot) {
+    dx_entry_t* tab = dx_table(image, dir);
+    uint64_t mask = dx_slots(image, dir) - 1;
+    uint32_t h = dirent_hash(name);
+    for (uint64_t n = 0, i = h & mask; n <= mask; n++, i = (i + 1) & mask) {
+        if (i == 0) continue;
+        if (tab[i].slot == 0) break;
+        if (tab[i].slot != slot + 1) continue;
+        // Tombstone, not empty: later entries of the same probe run stay reachable.
+        tab[i].slot = DX_TOMBSTONE;
+        if (slot < tab[0].slot) tab[0].slot = (uint32_t)slot;
+        return i;
+    }
+    return DX_NONE;
+}
+
+void dx_build(uint8_t* image, inode_t* dir, uint32_t start, uint32_t nblocks) {
+    dir->xattr_ptr = ((uint64_t)nblocks << 32) | start;
+    dx_entry_t* tab = dx_table(image, dir);
+    memset(tab, 0, (size_t)nblocks * image_bs(image));
+    uint64_t slots = dir->size_bytes / sizeof(dirent64_t);
+    tab[0].slot = (uint32_t)slots;
+    for (uint64_t i = 0; i < slots; i++) {
+        const dirent64_t* de = dir_slot(image, dir, i);
+        if (!de) break;
+        if (de->inode_no == 0) {
+            if (i < tab[0].slot) tab[0].slot = (uint32_t)i;
+            continue;
+        }
+        dx_insert(image, dir, de->name, i);
+    }
+}
+
+const dirent64_t* dir_lookup(const uint8_t* image, const inode_t* dir, const char* name) {
+    const superblock_t* sb = (const superblock_t*)image;
+    if ((sb->flags & SB_FLAG_DIR_INDEX) && dir->xattr_ptr &&
+        (uint64_t)dx_start(dir) + dx_blocks(dir) <= sb->total_blocks) {
+        uint64_t slot = dx_lookup(image, dir, name);
+        return slot == DX_NONE ? NULL : dir_slot(image, dir, slot);
+    }
+    uint64_t slots = dir->size_bytes / sizeof(dirent64_t);
+    for (uint64_t i = 0; i < slots; i++) {
+        const dirent64_t* de = dir_slot(image, dir, i);
+        if (!de) break;
+        if (de->inode_no != 0 && strncmp(de->name, name, sizeof(de->name)) == 0) return de;
+    }
+    return NULL;
+}
+
+uint32_t path_lookup(const uint8_t* image, const char* path) {
+    const superblock_t* sb = (const superblock_t*)image;
+    const inode_t* table = (const inode_t*)(image + sb->inode_table_start * sb->block_size);
+    uint32_t ino = ROOT_INO;
+    const char* p = path;
+    while (*p) {
+        while (*p == '/') p++;
+        size_t len = strcspn(p, "/");
+        if (len == 0) break;
+        if (len == 1 && p[0] == '.') { p += len; continue; }
+        char name[sizeof(((dirent64_t*)0)->name)];
+        if (len >= sizeof(name)) return 0;
+        memcpy(name, p, len);
+        name[len] = '\0';
+        if ((table[ino - 1].mode & 0170000) != MODE_DIR) return 0;
+        const dirent64_t* de = dir_lookup(image, &table[ino - 1], name);
+        if (!de || de->inode_no == 0 || de->inode_no > sb->inode_count) return 0;
+        ino = de->inode_no;
+        p += len;
+    }
+    return ino;
+}
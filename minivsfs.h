@@ -0,0 +1,415 @@
+// MiniVSFS on-disk format, shared by mkfs_builder, mkfs_adder and mkfs_check.
+#ifndef MINIVSFS_H
+#define MINIVSFS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "crc32.h"
+#include "compress.h"
+
+// Block size, chosen when the image is built and recorded in
+// superblock_t.block_size: a power of two in [BS_MIN, BS_MAX]. The per-block
+// counts below take it as `bs`; image_bs() reads it from an image.
+#define BS_DEFAULT 4096u
+#define BS_MIN 1024u
+#define BS_MAX 65536u
+#define INODE_SIZE 128u
+#define ROOT_INO 1u
+#define DIRECT_MAX 12
+#define MVFS_MAGIC 0x4D565346u // "MVFS"
+#define PTRS_PER_BLOCK(bs) ((bs) / sizeof(uint32_t))
+
+// Version 1 images map file data through direct[] only. Version 2 adds the
+// single- and double-indirect pointers in the inode; tools read both.
+#define MVFS_VERSION_DIRECT   1u
+#define MVFS_VERSION_INDIRECT 2u
+#define MVFS_VERSION          MVFS_VERSION_INDIRECT
+
+// superblock_t.flags: optional features chosen when the image is built.
+// Tools refuse images with flags they do not know.
+#define SB_FLAG_EXTENTS   0x1u  // new inodes map their data with extents
+#define SB_FLAG_DIR_INDEX 0x2u  // directories carry a hashed name index
+#define SB_FLAG_DEDUP     0x4u  // identical file blocks are shared, see refcount_t
+#define SB_FLAG_DATA_CSUM 0x8u  // data-region blocks carry CRC32C checksums
+#define SB_FLAG_COMPRESS  0x10u // some files are stored compressed, see INODE_FL_COMPRESSED
+#define SB_FLAG_INLINE_DATA 0x20u // small files live in their inode, see INODE_FL_INLINE
+#define SB_FLAG_JOURNAL   0x40u // in-place updates are committed through a journal, see journal_header_t
+#define SB_FLAGS_KNOWN    (SB_FLAG_EXTENTS | SB_FLAG_DIR_INDEX | SB_FLAG_DEDUP | SB_FLAG_DATA_CSUM | \
+                           SB_FLAG_COMPRESS | SB_FLAG_INLINE_DATA | SB_FLAG_JOURNAL)
+
+// inode_t.flags
+#define INODE_FL_EXTENTS    0x1u   // direct[] holds extent_t runs instead of block pointers
+#define INODE_FL_COMPRESSED 0x2u   // the mapped blocks hold compressed chunks, see COMPRESS_CHUNK
+#define INODE_FL_INLINE     0x4u   // the data is in the inode itself, see inode_inline_data()
+
+// Largest number of data blocks one inode can map.
+#define INODE_MAX_BLOCKS(bs) \
+    ((uint64_t)DIRECT_MAX + PTRS_PER_BLOCK(bs) + (uint64_t)PTRS_PER_BLOCK(bs) * PTRS_PER_BLOCK(bs))
+
+#define MODE_FILE 0100000
+#define MODE_DIR  0040000
+
+#define DIRENT_FILE 1
+#define DIRENT_DIR  2
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t total_blocks;
+    uint64_t inode_count;
+    uint64_t inode_bitmap_start;
+    uint64_t inode_bitmap_blocks;
+    uint64_t data_bitmap_start;
+    uint64_t data_bitmap_blocks;
+    uint64_t inode_table_start;
+    uint64_t inode_table_blocks;
+    uint64_t data_region_start;
+    uint64_t data_region_blocks;
+    uint64_t root_inode;
+    uint64_t mtime_epoch;
+    uint32_t flags;
+    uint32_t checksum;            // crc32(block 0 except its last 4 bytes)
+} superblock_t;
+#pragma pack(pop)
+_Static_assert(sizeof(superblock_t) == 116, "superblock must fit in one block");
+
+// Extra superblock fields, kept in the unused tail of block 0 so superblock_t
+// keeps its layout. They are covered by the superblock checksum, and images
+// written before a field existed have zero there, which every field treats as
+// its default.
+#define SB_EXT_OFFSET 128u
+
+#pragma pack(push, 1)
+typedef struct {
+    uint64_t inode_alloc_hint;    // inode index where the next inode search starts
+    uint64_t data_alloc_hint;     // data-region index where the next block search starts
+    uint64_t free_inodes;         // clear bits of the inode bitmap, if SB_EXT_FREE_COUNTS
+    uint64_t free_blocks;         // clear bits of the data bitmap, if SB_EXT_FREE_COUNTS
+    uint32_t ext_flags;           // SB_EXT_*
+    uint32_t refcount_blocks;     // SB_FLAG_DEDUP: refcount table size and
+    uint64_t refcount_start;      // location, between inode table and data region
+    uint32_t csum_blocks;         // SB_FLAG_DATA_CSUM: checksum table size and
+    uint64_t csum_start;          // location, after the refcount table
+    uint32_t journal_blocks;      // SB_FLAG_JOURNAL: journal size and location,
+    uint64_t journal_start;       // after the checksum table
+    uint64_t journal_seq;         // batches of changes stored so far
+} superblock_ext_t;
+#pragma pack(pop)
+_Static_assert(SB_EXT_OFFSET + sizeof(superblock_ext_t) <= BS_MIN - 4, "superblock extension must fit in block 0");
+
+// superblock_ext_t.ext_flags
+#define SB_EXT_FREE_COUNTS 0x1u   // free_inodes/free_blocks are maintained; older
+                                  // images get them counted on first load
+
+static inline superblock_ext_t *sb_ext(superblock_t *sb) {
+    return (superblock_ext_t *)((uint8_t *)sb + SB_EXT_OFFSET);
+}
+
+static inline int block_size_valid(uint64_t bs) {
+    return bs >= BS_MIN && bs <= BS_MAX && (bs & (bs - 1)) == 0;
+}
+
+// Block size of the image starting at `image` (validated when it was loaded).
+static inline uint32_t image_bs(const uint8_t *image) {
+    return ((const superblock_t *)image)->block_size;
+}
+
+// With SB_FLAG_DEDUP every allocated data-region block has a reference count:
+// the number of pointers to it (1 for anything not shared). A block shared by
+// several files is freed when its count drops to zero, and is copied before
+// one of them modifies it.
+typedef uint16_t refcount_t;
+#define REFCOUNT_MAX UINT16_MAX
+#define REFCOUNTS_PER_BLOCK(bs) ((bs) / sizeof(refcount_t))
+
+// With SB_FLAG_DATA_CSUM the checksum table holds the CRC32C of every
+// allocated data-region block (one uint32_t per block, in region order). Free
+// blocks' entries are meaningless. Tools refresh the entries of the blocks
+// they modified when they finalize the image.
+#define CSUMS_PER_BLOCK(bs) ((bs) / sizeof(uint32_t))
+
+// With SB_FLAG_JOURNAL, the journal is split into two slots of
+// journal_blocks / 2 blocks. Every batch of changes bumps journal_seq, and an
+// in-place store commits it as one transaction in slot journal_seq % 2: a
+// descriptor block (this header, then the numbers of the blocks logged)
+// followed by the logged blocks' new contents. One fsync makes the
+// transaction durable, then the blocks are written in place; those writes
+// are made durable only by the next batch's fsync, which is why the previous
+// transaction stays intact in the other slot. Blocks that were free when the
+// batch began are not logged: nothing on disk refers to them, so they are
+// written in place before the commit. Blocks the previous transaction
+// logged are always logged again, since its replay would overwrite them.
+// On open, both slots are considered, oldest first: a transaction whose seq
+// is the superblock's journal_seq or the one after is replayed, and so is a
+// newer one that directly follows a replayed one. A crash during a commit can
+// leave the previous batch partly in place, so both may be needed. A
+// transaction older than the superblock means the image moved on without it
+// (a full copy or a delta), and it is ignored.
+#define MVFS_JOURNAL_MAGIC 0x4D56464Au // "MVFJ"
+#define JOURNAL_MIN_BLOCKS 4u
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t magic;
+    uint32_t nblocks;             // blocks logged
+    uint64_t seq;                 // journal_seq of the batch
+    uint32_t checksum;            // crc32 of the header up to here, the block numbers, then the blocks
+} journal_header_t;
+#pragma pack(pop)
+
+// Block numbers one descriptor block holds, which bounds the journal size.
+#define JOURNAL_PER_DESC(bs) (((bs) - sizeof(journal_header_t)) / sizeof(uint32_t))
+#define JOURNAL_MAX_BLOCKS(bs) (2 * (1 + JOURNAL_PER_DESC(bs)))
+
+// Most blocks one transaction can log in a journal of `journal_blocks`.
+static inline uint64_t journal_capacity(uint64_t journal_blocks, uint32_t bs) {
+    uint64_t slot = journal_blocks / 2;
+    if (slot < 2) return 0;
+    return slot - 1 < JOURNAL_PER_DESC(bs) ? slot - 1 : JOURNAL_PER_DESC(bs);
+}
+
+// Delta files hold only the blocks one change modified, against a base image
+// (or the base with earlier deltas applied). Block 0 is this header, followed
+// by map_blocks blocks with one bit per image block (set = stored), then the
+// stored blocks in ascending order, each block-aligned so the data can be
+// reflinked. Blocks are the image's block size. A delta applies only to the
+// image whose superblock checksum is base_checksum, which chains deltas in the
+// order they were made.
+#define MVFS_DELTA_MAGIC   0x4D564644u // "MVFD"
+#define MVFS_DELTA_VERSION 1u
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t total_blocks;        // of the image it applies to
+    uint64_t map_blocks;
+    uint64_t block_count;         // blocks stored
+    uint32_t base_checksum;       // superblock checksum before applying
+    uint32_t result_checksum;     // superblock checksum after applying
+    uint32_t checksum;            // crc32 of the header up to here, then of the map
+} delta_header_t;
+#pragma pack(pop)
+
+static inline uint64_t delta_map_blocks(uint64_t total_blocks, uint32_t bs) {
+    return (total_blocks + (uint64_t)bs * 8 - 1) / ((uint64_t)bs * 8);
+}
+
+#pragma pack(push, 1)
+typedef struct {
+    uint16_t mode;
+    uint16_t links;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t size_bytes;
+    uint64_t atime;
+    uint64_t mtime;
+    uint64_t ctime;
+    uint32_t direct[12];
+    uint32_t indirect;        // block of PTRS_PER_BLOCK(bs) data pointers (version >= 2)
+    uint32_t double_indirect; // block of pointers to indirect blocks (version >= 2)
+    uint32_t flags;           // INODE_FL_*
+    uint32_t proj_id;
+    uint32_t uid16_gid16;
+    uint64_t xattr_ptr;       // directories with SB_FLAG_DIR_INDEX: hash index location, see dx_*;
+                              // files with INODE_FL_COMPRESSED: compressed layout
+    uint64_t inode_crc;  // low 4 bytes store crc32 of bytes [0..119]; high 4 bytes 0
+} inode_t;
+#pragma pack(pop)
+_Static_assert(sizeof(inode_t)==INODE_SIZE, "inode size mismatch");
+
+// With SB_FLAG_INLINE_DATA, a file of at most INODE_INLINE_MAX bytes keeps
+// its data in direct[], indirect and double_indirect (contiguous in the
+// packed inode) and has no data blocks; the bytes past size_bytes are zero.
+// Reading it costs only the inode-table read. It moves to a data block when
+// it grows past the limit.
+#define INODE_INLINE_MAX (offsetof(inode_t, flags) - offsetof(inode_t, direct))
+_Static_assert(INODE_INLINE_MAX == 56, "inline area is direct[] through double_indirect");
+
+static inline uint8_t* inode_inline_data(inode_t* ino) {
+    return (uint8_t*)ino->direct;
+}
+
+// With INODE_FL_EXTENTS, direct[] holds INODE_EXTENTS runs of consecutive
+// blocks in file order, ended by a zero length. If a file needs more runs,
+// `indirect` points at a block holding EXTENTS_PER_BLOCK(bs) further runs.
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t start;
+    uint32_t len;
+} extent_t;
+#pragma pack(pop)
+#define INODE_EXTENTS (sizeof(((inode_t*)0)->direct) / sizeof(extent_t))
+#define EXTENTS_PER_BLOCK(bs) ((bs) / sizeof(extent_t))
+#define INODE_MAX_EXTENTS(bs) ((uint64_t)INODE_EXTENTS + EXTENTS_PER_BLOCK(bs))
+
+// A file with INODE_FL_COMPRESSED is cut into COMPRESS_CHUNK-byte chunks
+// (the last one shorter), each compressed on its own so a read decompresses
+// only the chunks it covers. Its mapped blocks hold a byte stream: a table of
+// nchunks + 1 uint32_t offsets into the stream, then the chunks back to back;
+// chunk i is bytes [table[i], table[i+1]). A chunk that would not shrink is
+// stored as is, recognisable by its length. size_bytes stays the file's
+// length; xattr_ptr holds the stream length (low 32 bits) and the algorithm,
+// COMPRESS_* (bits 32..39).
+#define COMPRESS_CHUNK 65536u
+
+static inline unsigned inode_compress_alg(const inode_t* ino) {
+    return (unsigned)(ino->xattr_ptr >> 32) & 0xFF;
+}
+static inline uint64_t inode_stored_bytes(const inode_t* ino) {
+    return (ino->flags & INODE_FL_COMPRESSED) ? (uint32_t)ino->xattr_ptr : ino->size_bytes;
+}
+// Number of `bs`-byte data blocks the inode maps.
+static inline uint64_t inode_data_blocks(const inode_t* ino, uint32_t bs) {
+    if (ino->flags & INODE_FL_INLINE) return 0;
+    return (inode_stored_bytes(ino) + bs - 1) / bs;
+}
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t inode_no;
+    uint8_t  type;       // 1=file, 2=dir
+    char     name[58];
+    uint8_t  checksum;   // XOR of bytes 0..62
+} dirent64_t;
+#pragma pack(pop)
+_Static_assert(sizeof(dirent64_t)==64, "dirent size mismatch");
+
+#define DIRENTS_PER_BLOCK(bs) ((bs) / sizeof(dirent64_t))
+
+// Hashed directory index. The directory's xattr_ptr holds the first block
+// (low 32 bits) and block count (high 32 bits, a power of two) of a
+// contiguous open-addressing table of dx_entry_t, probed linearly from
+// hash & (slots - 1). Entry 0 is a header instead: `hash` counts occupied
+// entries (tombstones included) and `slot` is the lowest dirent slot that
+// may be free. A lookup reads one index block plus the dirent blocks of
+// entries whose hash matches.
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t hash;
+    uint32_t slot;       // dirent slot + 1; 0 = empty, DX_TOMBSTONE = removed
+} dx_entry_t;
+#pragma pack(pop)
+#define DX_TOMBSTONE UINT32_MAX
+#define DX_ENTRIES_PER_BLOCK(bs) ((bs) / sizeof(dx_entry_t))
+#define DX_MAX_BLOCKS 256u
+#define DX_NONE UINT64_MAX
+
+// WARNING: CALL THESE ONLY AFTER ALL OTHER FIELDS OF THE STRUCTURE HAVE BEEN FINALIZED
+// superblock_crc_finalize() covers the whole of block 0 (block_size bytes),
+// so `sb` must point at block 0 of an image, not at a stack copy, and its
+// block_size must be valid.
+uint32_t superblock_crc_finalize(superblock_t *sb);
+void inode_crc_finalize(inode_t* ino);
+void dirent_checksum_finalize(dirent64_t* de);
+
+// Return non-zero when the stored checksum matches the contents.
+int superblock_crc_ok(const superblock_t *sb);
+int inode_crc_ok(const inode_t* ino);
+int dirent_checksum_ok(const dirent64_t* de);
+
+// Lays the pending journal transactions of an SB_FLAG_JOURNAL image (see
+// journal_header_t) over `image`, which must be writable, e.g. a private
+// mapping. Returns the number of blocks whose contents changed, setting
+// their bits in `changed` if it is not NULL; 0 if nothing was pending or
+// the image has no journal.
+uint64_t journal_replay(uint8_t* image, uint8_t* changed);
+
+// Checksum table of an SB_FLAG_DATA_CSUM image, or NULL.
+const uint32_t* data_csums(const uint8_t* image);
+// Verifies blocks [blk, blk+n) against the checksum table. Returns 0 if all
+// match (or the image has none), else -1 with the first bad block in `*bad`.
+int data_csum_check(const uint8_t* image, uint32_t blk, uint64_t n, uint32_t* bad);
+
+// Block mapping. `image` is the whole image starting at block 0.
+
+// Number of indirect/double-indirect pointer blocks needed to map `ndata` data blocks.
+uint64_t inode_pointer_blocks(uint64_t ndata, uint32_t bs);
+
+// Physical block holding file block `index`, or 0 if it is unmapped or a
+// pointer block on the way lies outside the data region. Handles both
+// pointer-mapped and extent-mapped inodes; inline inodes map nothing.
+uint32_t inode_bmap(const uint8_t* image, const inode_t* ino, uint64_t index);
+
+// Where a pointer-mapped inode stores the number of file block `index`: a
+// slot in direct[] or in a pointer block. NULL for extent-mapped and inline
+// inodes and when a pointer block on the way is missing.
+uint32_t* inode_block_slot(uint8_t* image, inode_t* ino, uint64_t index);
+
+// i-th extent of an extent-mapped inode, or NULL past the last slot or if the
+// extent block lies outside the data region. A zero `len` ends the list.
+const extent_t* inode_extent(const uint8_t* image, const inode_t* ino, uint64_t i);
+
+// Decompresses chunk `chunk` of compressed file `ino` into `out`, with
+// `scratch` for the compressed bytes (both COMPRESS_CHUNK bytes). Blocks are
+// verified against the checksum table on images that have one. Returns the
+// chunk's length, or -1 if it is damaged or the algorithm is not built in.
+int compressed_chunk(const uint8_t* image, const inode_t* ino, uint64_t chunk, uint8_t* out, uint8_t* scratch);
+
+// Number of runs of consecutive block numbers in `blocks`.
+uint64_t extent_count_runs(const uint32_t* blocks, uint64_t n);
+
+// Maps `ino` to the `n` data blocks in `blocks` (file order) using extents
+// and sets INODE_FL_EXTENTS. `extent_block` is a free block used when there
+// are more than INODE_EXTENTS runs, otherwise it must be 0.
+void inode_set_extents(uint8_t* image, inode_t* ino, const uint32_t* blocks, uint64_t n, uint32_t extent_block);
+
+// Growing an inode one block at a time (used for directories). `index` is
+// the inode's current block count and `blk` the new block.
+// inode_append_needs() returns how many zeroed pointer/extent blocks the
+// append consumes (0-2), or -1 if the inode cannot map another block.
+// inode_append_block() performs it, taking those blocks from `spare`, and
+// returns the existing pointer/extent block it modified (0 if only the inode
+// itself and the spare blocks changed).
+int inode_append_needs(const uint8_t* image, const inode_t* ino, uint64_t index, uint32_t blk);
+uint32_t inode_append_block(uint8_t* image, inode_t* ino, uint64_t index, uint32_t blk, const uint32_t* spare);
+
+// Directory entries. dir_slot() returns NULL if the slot's block is unmapped.
+const dirent64_t* dir_slot(const uint8_t* image, const inode_t* dir, uint64_t slot);
+
+// Entry named `name` in `dir`, through its hash index when the image has one,
+// or NULL.
+const dirent64_t* dir_lookup(const uint8_t* image, const inode_t* dir, const char* name);
+
+// Inode number of `path` (components separated by '/', relative to the root),
+// or 0 if it does not exist.
+uint32_t path_lookup(const uint8_t* image, const char* path);
+
+// Hashed directory index (see dx_entry_t).
+static inline uint32_t dx_start(const inode_t* dir) { return (uint32_t)dir->xattr_ptr; }
+static inline uint32_t dx_blocks(const inode_t* dir) { return (uint32_t)(dir->xattr_ptr >> 32); }
+static inline dx_entry_t* dx_table(uint8_t* image, const inode_t* dir) {
+    return (dx_entry_t*)(image + (uint64_t)dx_start(dir) * image_bs(image));
+}
+
+uint32_t dirent_hash(const char* name);
+
+// Slot of `name` in an indexed directory, or DX_NONE.
+uint64_t dx_lookup(const uint8_t* image, const inode_t* dir, const char* name);
+
+// Non-zero when one more insert would push the table past 3/4 full.
+int dx_needs_grow(uint8_t* image, const inode_t* dir);
+
+// Records `name` at dirent `slot`; returns the table index written, which
+// with entry 0 (the header) are the two entries the caller must persist.
+uint64_t dx_insert(uint8_t* image, const inode_t* dir, const char* name, uint64_t slot);
+
+// Marks the entry for `name` at dirent `slot` removed and lowers the header's
+// free-slot hint; returns the table index written (DX_NONE if not found).
+uint64_t dx_remove(uint8_t* image, const inode_t* dir, const char* name, uint64_t slot);
+
+// Points `dir` at the run [start, start+nblocks), clears it and fills it
+// from the directory's live entries.
+void dx_build(uint8_t* image, inode_t* dir, uint32_t start, uint32_t nblocks);
+
+// Points `ino` at `ndata` data blocks. `blocks` holds ndata +
+// inode_pointer_blocks(ndata) free block numbers in disk order; each pointer
+// block is placed just before the data it maps, so a contiguous `blocks`
+// range gives a file that reads sequentially. The pointer blocks are written
+// into the image and the data block numbers, in file order, go to `data_out`.
+void inode_set_blocks(uint8_t* image, inode_t* ino, const uint32_t* blocks, uint64_t ndata, uint32_t* data_out);
+
+#endif
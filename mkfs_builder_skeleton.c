@@ -1,5 +1,6 @@
-// Build: gcc -O2 -std=c17 -Wall -Wextra mkfs_minivsfs.c -o mkfs_builder
+// Build: gcc -O2 -std=c17 -Wall -Wextra -pthread mkfs_builder_skeleton.c image.c minivsfs.c bitmap.c crc32.c compress.c -o mkfs_builder
 #define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -8,126 +9,112 @@
 #include <errno.h>
 #include <time.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
-#define BS 4096u               // block size
-#define INODE_SIZE 128u
-#define ROOT_INO 1u
+#include "minivsfs.h"
+#include "image.h"
 
 uint64_t g_random_seed = 0; // This should be replaced by seed value from the CLI.
 
-// below contains some basic structures you need for your project
-// you are free to create more structures as you require
-
-#pragma pack(push, 1)
-typedef struct {
-    // CREATE YOUR SUPERBLOCK HERE
-    // ADD ALL FIELDS AS PROVIDED BY THE SPECIFICATION
-    
-    // THIS FIELD SHOULD STAY AT THE END
-    // ALL OTHER FIELDS SHOULD BE ABOVE THIS
-    uint32_t magic;
-    uint32_t version;
-    uint32_t block_size;
-    uint64_t total_blocks;
-    uint64_t inode_count;
-    uint64_t inode_bitmap_start;
-    uint64_t inode_bitmap_blocks;
-    uint64_t data_bitmap_start;
-    uint64_t data_bitmap_blocks;
-    uint64_t inode_table_start;
-    uint64_t inode_table_blocks;
-    uint64_t data_region_start;
-    uint64_t data_region_blocks;
-    uint64_t root_inode;
-    uint64_t mtime_epoch;
-    uint32_t flags;
-    uint32_t checksum;            // crc32(superblock[0..4091])
-} superblock_t;
-#pragma pack(pop)
-_Static_assert(sizeof(superblock_t) == 116, "superblock must fit in one block");
-
-#pragma pack(push,1)
-typedef struct {
-    // CREATE YOUR INODE HERE
-    // IF CREATED CORRECTLY, THE STATIC_ASSERT ERROR SHOULD BE GONE
-
-    // THIS FIELD SHOULD STAY AT THE END
-    // ALL OTHER FIELDS SHOULD BE ABOVE THIS
-    uint16_t mode;
-    uint16_t links;
-    uint32_t uid;
-    uint32_t gid;
-    uint64_t size_bytes;
-    uint64_t atime;
-    uint64_t mtime;
-    uint64_t ctime;
-    uint32_t direct[12];
-    uint32_t reserved_0;
-    uint32_t reserved_1;
-    uint32_t reserved_2;
-    uint32_t proj_id;
-    uint32_t uid16_gid16;
-    uint64_t xattr_ptr;
-    uint64_t inode_crc;  // low 4 bytes store crc32 of bytes [0..119]; high 4 bytes 0
-
-} inode_t;
-#pragma pack(pop)
-_Static_assert(sizeof(inode_t)==INODE_SIZE, "inode size mismatch");
-
-#pragma pack(push,1)
-typedef struct {
-    // CREATE YOUR DIRECTORY ENTRY STRUCTURE HERE
-    // IF CREATED CORRECTLY, THE STATIC_ASSERT ERROR SHOULD BE GONE
-    uint32_t inode_no;
-    uint8_t  type;       // 1=file, 2=dir
-    char     name[58];
-    uint8_t  checksum; // XOR of bytes 0..62
-} dirent64_t;
-#pragma pack(pop)
-_Static_assert(sizeof(dirent64_t)==64, "dirent size mismatch");
-
-
-// ==========================DO NOT CHANGE THIS PORTION=========================
-// These functions are there for your help. You should refer to the specifications to see how you can use them.
-// ====================================CRC32====================================
-uint32_t CRC32_TAB[256];
-void crc32_init(void){
-    for (uint32_t i=0;i<256;i++){
-        uint32_t c=i;
-        for(int j=0;j<8;j++) c = (c&1)?(0xEDB88320u^(c>>1)):(c>>1);
-        CRC32_TAB[i]=c;
+// Largest --inodes: a 2 GiB inode table.
+#define INODES_MAX (1u << 24)
+
+static int block_is_zero(const uint8_t* blk, uint64_t bs) {
+    for (size_t i = 0; i < bs; i++) if (blk[i]) return 0;
+    return 1;
+}
+
+// Writes the image as a sparse file: the file is extended to its full size
+// with ftruncate and only the non-zero blocks among the first `nblocks` are
+// written, one pwrite per run of them. With `preallocate`, the full extent is
+// reserved with fallocate.
+static int write_sparse_image(const char* path, const uint8_t* blocks, uint64_t nblocks,
+                              uint64_t total_blocks, uint64_t bs, int preallocate) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) { perror("open"); return -1; }
+    off_t total_bytes = (off_t)(total_blocks * bs);
+    if (ftruncate(fd, total_bytes) != 0) { perror("ftruncate"); close(fd); return -1; }
+    if (preallocate && fallocate(fd, 0, 0, total_bytes) != 0) {
+        perror("fallocate"); close(fd); return -1;
+    }
+    for (uint64_t b = 0; b < nblocks;) {
+        if (block_is_zero(blocks + b*bs, bs)) { b++; continue; }
+        uint64_t end = b + 1;
+        while (end < nblocks && !block_is_zero(blocks + end*bs, bs)) end++;
+        const uint8_t* src = blocks + b*bs;
+        size_t len = (size_t)((end - b) * bs);
+        off_t off = (off_t)(b*bs);
+        while (len > 0) {
+            ssize_t n = pwrite(fd, src, len, off);
+            if (n < 0) { perror("pwrite"); close(fd); return -1; }
+            src += n; len -= (size_t)n; off += n;
+        }
+        b = end;
     }
+    if (close(fd) != 0) { perror("close"); return -1; }
+    return 0;
 }
-uint32_t crc32(const void* data, size_t n){
-    const uint8_t* p=(const uint8_t*)data; uint32_t c=0xFFFFFFFFu;
-    for(size_t i=0;i<n;i++) c = CRC32_TAB[(c^p[i])&0xFF] ^ (c>>8);
-    return c ^ 0xFFFFFFFFu;
+
+// The output being built through a shared mapping, for the SIGBUS handler.
+static const char* g_mapped_output = NULL;
+
+// A store into a hole of the mapping that the host filesystem cannot back
+// (out of space or quota) raises SIGBUS instead of returning an error. Only
+// async-signal-safe calls here: report, drop the partial image, exit.
+static void output_sigbus(int sig) {
+    (void)sig;
+    static const char msg[] = "Failed to write the image: no space left for the output file.\n";
+    ssize_t n = write(STDERR_FILENO, msg, sizeof(msg) - 1);
+    (void)n;
+    if (g_mapped_output) unlink(g_mapped_output);
+    _exit(1);
 }
-// ====================================CRC32====================================
-
-// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
-static uint32_t superblock_crc_finalize(superblock_t *sb) {
-    sb->checksum = 0;
-    uint32_t s = crc32((void *) sb, BS - 4);
-    sb->checksum = s;
-    return s;
+
+// Creates the output image file of `total_bytes` and maps it shared, for an
+// image built in place: blocks never written stay holes, and the image need
+// not fit in memory. Returns the mapping, or NULL; the file stays open as
+// `*fd_out` for unmap_output_image().
+static uint8_t* map_output_image(const char* path, uint64_t total_bytes, int preallocate, int* fd_out) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) { perror("open"); return NULL; }
+    if (ftruncate(fd, (off_t)total_bytes) != 0) { perror("ftruncate"); close(fd); return NULL; }
+    if (preallocate && fallocate(fd, 0, 0, (off_t)total_bytes) != 0) {
+        perror("fallocate"); close(fd); return NULL;
+    }
+    void* image = mmap(NULL, total_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (image == MAP_FAILED) { perror("mmap"); close(fd); return NULL; }
+    g_mapped_output = path;
+    struct sigaction sa = { .sa_handler = output_sigbus };
+    sigaction(SIGBUS, &sa, NULL);
+    *fd_out = fd;
+    return image;
 }
 
-// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
-void inode_crc_finalize(inode_t* ino){
-    uint8_t tmp[INODE_SIZE]; memcpy(tmp, ino, INODE_SIZE);
-    // zero crc area before computing
-    memset(&tmp[120], 0, 8);
-    uint32_t c = crc32(tmp, 120);
-    ino->inode_crc = (uint64_t)c; // low 4 bytes carry the crc
+// Writes the mapping back and closes the file, reporting writeback errors
+// that would otherwise be lost with the mapping.
+static int unmap_output_image(uint8_t* image, uint64_t total_bytes, int fd) {
+    int rc = 0;
+    if (msync(image, total_bytes, MS_SYNC) != 0) { perror("msync"); rc = -1; }
+    munmap(image, total_bytes);
+    if (rc == 0 && fsync(fd) != 0) { perror("fsync"); rc = -1; }
+    if (close(fd) != 0 && rc == 0) { perror("close"); rc = -1; }
+    return rc;
 }
 
-// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
-void dirent_checksum_finalize(dirent64_t* de) {
-    const uint8_t* p = (const uint8_t*)de;
-    uint8_t x = 0;
-    for (int i = 0; i < 63; i++) x ^= p[i];   // covers ino(4) + type(1) + name(58)
-    de->checksum = x;
+// Adds the tree under `dir` to the image: every directory first, so they sit
+// together after the root, then the files, whose data is laid out
+// contiguously in traversal order.
+static int import_tree(image_t* img, const char* dir, long threads) {
+    file_list_t files = {0}, dirs = {0};
+    int rc = collect_dir(&files, &dirs, dir);
+    for (size_t i = 0; rc == 0 && i < dirs.count; i++) rc = image_mkdir(img, dirs.paths[i] + dirs.dst[i]);
+    if (rc == 0) rc = add_files(img, &files, threads);
+    file_list_free(&files);
+    file_list_free(&dirs);
+    return rc;
 }
 
 int main(int argc, char* argv[]) {
@@ -138,73 +125,166 @@ int main(int argc, char* argv[]) {
     // THEN CREATE YOUR FILE SYSTEM WITH A ROOT DIRECTORY
     // THEN SAVE THE DATA INSIDE THE OUTPUT IMAGE
     const char* image_name = NULL;
-    uint64_t size_kib = 0, inode_count = 0;
+    const char* from_dir = NULL;
+    const char* source_date = NULL;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t size_kib = 0, inode_count = 0, bs = BS_DEFAULT, journal_blocks = 0;
+    int preallocate = 0;
+    uint32_t sb_flags = 0;
+    int compress = COMPRESS_NONE;
 
     for (int i = 1; i < argc; i++) {
         if (!strcmp(argv[i], "--image") && i+1 < argc) image_name = argv[++i];
         else if (!strcmp(argv[i], "--size-kib") && i+1 < argc) size_kib = strtoull(argv[++i], NULL, 10);
         else if (!strcmp(argv[i], "--inodes") && i+1 < argc) inode_count = strtoull(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--block-size") && i+1 < argc) bs = strtoull(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--preallocate")) preallocate = 1;
+        else if (!strcmp(argv[i], "--extents")) sb_flags |= SB_FLAG_EXTENTS;
+        else if (!strcmp(argv[i], "--dir-index")) sb_flags |= SB_FLAG_DIR_INDEX;
+        else if (!strcmp(argv[i], "--dedup")) sb_flags |= SB_FLAG_DEDUP;
+        else if (!strcmp(argv[i], "--data-csum")) sb_flags |= SB_FLAG_DATA_CSUM;
+        else if (!strcmp(argv[i], "--inline-data")) sb_flags |= SB_FLAG_INLINE_DATA;
+        else if (!strcmp(argv[i], "--journal") && i+1 < argc) {
+            journal_blocks = strtoull(argv[++i], NULL, 10);
+            sb_flags |= SB_FLAG_JOURNAL;
+        }
+        else if (!strcmp(argv[i], "--from-dir") && i+1 < argc) from_dir = argv[++i];
+        else if (!strcmp(argv[i], "--threads") && i+1 < argc) threads = strtol(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--source-date-epoch") && i+1 < argc) source_date = argv[++i];
+        else if (!strcmp(argv[i], "--compress") && i+1 < argc) {
+            if ((compress = compress_parse(argv[++i])) < 0) return 2;
+        }
         else {
             fprintf(stderr, "Unknown or incomplete flag near '%s'\n", argv[i]);
             return 2;
         }
     }
 
-    if (!image_name || size_kib < 180 || size_kib > 4096 || (size_kib % 4) != 0 ||
-        inode_count < 128 || inode_count > 512) {
-        fprintf(stderr, "Usage: --image <out.img> --size-kib <180..4096, multiple of 4> --inodes <128..512>\n");
+    // Block numbers are 32-bit, which bounds the image at 2^32 - 1 blocks
+    // (16 TiB with 4 KiB blocks).
+    if (!image_name || !block_size_valid(bs) || size_kib < 180 || (size_kib % (bs / 1024)) != 0 ||
+        size_kib / (bs / 1024) > UINT32_MAX || inode_count < 128 || inode_count > INODES_MAX || threads < 1 ||
+        ((sb_flags & SB_FLAG_JOURNAL) &&
+         (journal_blocks < JOURNAL_MIN_BLOCKS || journal_blocks > JOURNAL_MAX_BLOCKS(bs)))) {
+        fprintf(stderr, "Usage: --image <out.img> --size-kib <180.., multiple of the block size> --inodes <128..%u> [--block-size <1024..65536, power of 2; default 4096>] [--preallocate] [--extents | --dedup] [--dir-index] [--data-csum] [--inline-data] [--journal <%u..%llu blocks>] [--from-dir <path> [--threads <n>] [--compress <lz4|zstd>]] [--source-date-epoch <seconds>]\n",
+                INODES_MAX, JOURNAL_MIN_BLOCKS,
+                block_size_valid(bs) ? (unsigned long long)JOURNAL_MAX_BLOCKS(bs) : (unsigned long long)JOURNAL_MAX_BLOCKS(BS_DEFAULT));
+        return 2;
+    }
+    // Copying a shared block out of a file needs a pointer slot to redirect;
+    // splitting extents for it is not supported.
+    if ((sb_flags & SB_FLAG_EXTENTS) && (sb_flags & SB_FLAG_DEDUP)) {
+        fprintf(stderr, "--dedup cannot be combined with --extents.\n");
+        return 2;
+    }
+    // Only imported files are compressed; an empty image has none.
+    if (compress != COMPRESS_NONE && !from_dir) {
+        fprintf(stderr, "--compress requires --from-dir.\n");
         return 2;
     }
 
-    uint64_t total_blocks = (size_kib * 1024u) / BS;
-    uint64_t inode_table_blocks = (inode_count * INODE_SIZE + BS - 1) / BS;
+    uint64_t total_blocks = size_kib / (bs / 1024);
+    uint64_t inode_table_blocks = (inode_count * INODE_SIZE + bs - 1) / bs;
 
-    const uint64_t inode_bitmap_start = 1;
-    const uint64_t data_bitmap_start  = 2;
-    const uint64_t inode_table_start  = 3;
-    const uint64_t data_region_start  = inode_table_start + inode_table_blocks;
+    // The bitmaps take as many blocks as their bits need; the data bitmap is
+    // sized for every block of the image, a little more than the data region.
+    const uint64_t inode_bitmap_start  = 1;
+    const uint64_t inode_bitmap_blocks = (inode_count + bs * 8 - 1) / (bs * 8);
+    const uint64_t data_bitmap_start   = inode_bitmap_start + inode_bitmap_blocks;
+    const uint64_t data_bitmap_blocks  = (total_blocks + bs * 8 - 1) / (bs * 8);
+    const uint64_t inode_table_start   = data_bitmap_start + data_bitmap_blocks;
+    // Dedup images keep a reference count per data block after the inode table.
+    const uint64_t refcount_start      = inode_table_start + inode_table_blocks;
+    const uint64_t refcount_blocks     = (sb_flags & SB_FLAG_DEDUP)
+        ? (total_blocks + REFCOUNTS_PER_BLOCK(bs) - 1) / REFCOUNTS_PER_BLOCK(bs) : 0;
+    // Checksummed images keep a CRC32C per data block after that.
+    const uint64_t csum_start          = refcount_start + refcount_blocks;
+    const uint64_t csum_blocks         = (sb_flags & SB_FLAG_DATA_CSUM)
+        ? (total_blocks + CSUMS_PER_BLOCK(bs) - 1) / CSUMS_PER_BLOCK(bs) : 0;
+    // Journaled images reserve the journal after that.
+    const uint64_t journal_start       = csum_start + csum_blocks;
+    const uint64_t data_region_start   = journal_start + journal_blocks;
     if (data_region_start >= total_blocks) {
         fprintf(stderr, "Configuration leaves no data region.\n");
         return 2;
     }
-    const uint64_t data_region_blocks = total_blocks - data_region_start;
+    const uint64_t data_region_blocks  = total_blocks - data_region_start;
+
+    // --source-date-epoch or $SOURCE_DATE_EPOCH replace the current time, so
+    // the same inputs give a bit-identical image.
+    uint64_t now;
+    int reproducible;
+    if (image_timestamp(source_date, &now, &reproducible) != 0) return 2;
 
-    // Allocate and zero entire image
-    uint8_t* image = (uint8_t*)calloc(total_blocks, BS);
-    if (!image) { perror("calloc"); return 1; }
+    // Only the metadata blocks, the root directory block and the root's index
+    // block can be non-zero, so that prefix is all we build in memory; the
+    // rest stays a hole. An imported tree needs the whole image, which is
+    // built in the output file itself.
+    const uint64_t meta_blocks = data_region_start + ((sb_flags & SB_FLAG_DIR_INDEX) ? 2 : 1);
+    int out_fd = -1;
+    uint8_t* image = from_dir ? map_output_image(image_name, total_blocks * bs, preallocate, &out_fd)
+                              : (uint8_t*)calloc(meta_blocks, bs);
+    if (!image) {
+        if (!from_dir) perror("calloc");
+        return 1;
+    }
 
     // Build and place superblock into block 0
-    time_t now = time(NULL);
     superblock_t sb = {
-        .magic = 0x4D565346u,        // "MVFS"
-        .version = 1u,
-        .block_size = BS,
+        .magic = MVFS_MAGIC,
+        .version = MVFS_VERSION,
+        .block_size = (uint32_t)bs,
         .total_blocks = total_blocks,
         .inode_count = inode_count,
         .inode_bitmap_start = inode_bitmap_start,
-        .inode_bitmap_blocks = 1u,
+        .inode_bitmap_blocks = inode_bitmap_blocks,
         .data_bitmap_start = data_bitmap_start,
-        .data_bitmap_blocks = 1u,
+        .data_bitmap_blocks = data_bitmap_blocks,
         .inode_table_start = inode_table_start,
         .inode_table_blocks = inode_table_blocks,
         .data_region_start = data_region_start,
         .data_region_blocks = data_region_blocks,
         .root_inode = ROOT_INO,
-        .mtime_epoch = (uint64_t)now,
-        .flags = 0u,
+        .mtime_epoch = now,
+        .flags = sb_flags,
         .checksum = 0u
     };
     // Copy struct into block 0; block tail stays zero
-    memcpy(image + 0*BS, &sb, sizeof(sb));
-    // Compute checksum over the entire 4 KiB block (not the stack struct)
-    superblock_crc_finalize((superblock_t*)(image + 0*BS));
+    memcpy(image + 0*bs, &sb, sizeof(sb));
+    // Free counters: everything but the root inode, its directory block and
+    // its index block.
+    superblock_ext_t* ext = sb_ext((superblock_t*)image);
+    ext->free_inodes = inode_count - 1;
+    ext->free_blocks = data_region_blocks - ((sb_flags & SB_FLAG_DIR_INDEX) ? 2 : 1);
+    ext->ext_flags = SB_EXT_FREE_COUNTS;
+    if (sb_flags & SB_FLAG_DEDUP) {
+        ext->refcount_start = refcount_start;
+        ext->refcount_blocks = (uint32_t)refcount_blocks;
+    }
+    if (sb_flags & SB_FLAG_DATA_CSUM) {
+        ext->csum_start = csum_start;
+        ext->csum_blocks = (uint32_t)csum_blocks;
+    }
+    if (sb_flags & SB_FLAG_JOURNAL) {
+        ext->journal_start = journal_start;
+        ext->journal_blocks = (uint32_t)journal_blocks;
+    }
+    // Compute checksum over the entire block (not the stack struct)
+    superblock_crc_finalize((superblock_t*)(image + 0*bs));
 
     // Mark root inode and its first data block in bitmaps
-    uint8_t* inode_bmp = image + inode_bitmap_start*BS;
-    uint8_t* data_bmp  = image + data_bitmap_start*BS;
+    uint8_t* inode_bmp = image + inode_bitmap_start*bs;
+    uint8_t* data_bmp  = image + data_bitmap_start*bs;
 
     inode_bmp[0] |= 0x01; // set bit 0 (inode #1)
     data_bmp[0]  |= 0x01; // set bit 0 (first data block)
+    if (sb_flags & SB_FLAG_DIR_INDEX)
+        data_bmp[0] |= 0x02; // set bit 1 (root's index block)
+    if (sb_flags & SB_FLAG_DEDUP) {
+        refcount_t* refs = (refcount_t*)(image + refcount_start*bs);
+        refs[0] = 1;
+        if (sb_flags & SB_FLAG_DIR_INDEX) refs[1] = 1;
+    }
 
 
     // Create root inode in inode table (inode index 0 -> ino #1)
@@ -214,15 +294,16 @@ int main(int argc, char* argv[]) {
     root.uid = 0;
     root.gid = 0;
     root.size_bytes = 2u * sizeof(dirent64_t);
-    root.atime = root.mtime = root.ctime = (uint64_t)now;
+    root.atime = root.mtime = root.ctime = now;
     memset(root.direct, 0, sizeof(root.direct));
     root.direct[0] = (uint32_t)data_region_start;
+    if (sb_flags & SB_FLAG_EXTENTS) {
+        root.direct[1] = 1;  // direct[0..1] is the extent {start, len}
+        root.flags = INODE_FL_EXTENTS;
+    }
     root.proj_id = 0;         // set to your group ID if required
     root.uid16_gid16 = 0;
     root.xattr_ptr = 0;
-    inode_crc_finalize(&root);
-
-    memcpy(image + inode_table_start*BS + 0*INODE_SIZE, &root, sizeof(root));
 
     // Write "." and ".." directory entries into the first data block
     dirent64_t dot = {0};
@@ -237,16 +318,47 @@ int main(int argc, char* argv[]) {
     strcpy(dotdot.name, "..");
     dirent_checksum_finalize(&dotdot);
 
-    uint8_t* root_block = image + data_region_start*BS;
+    uint8_t* root_block = image + data_region_start*bs;
     memcpy(root_block, &dot, sizeof(dot));
     memcpy(root_block + sizeof(dot), &dotdot, sizeof(dotdot));
 
+    // The index is built from the entries, so it comes after them
+    if (sb_flags & SB_FLAG_DIR_INDEX)
+        dx_build(image, &root, (uint32_t)data_region_start + 1, 1);
+    inode_crc_finalize(&root);
+
+    memcpy(image + inode_table_start*bs + 0*INODE_SIZE, &root, sizeof(root));
+
+    if (sb_flags & SB_FLAG_DATA_CSUM)
+        crc32c_blocks(root_block, (sb_flags & SB_FLAG_DIR_INDEX) ? 2 : 1, bs,
+                      (uint32_t*)(image + csum_start*bs));
+
+    if (from_dir) {
+        image_t img;
+        int rc = image_attach(&img, image, total_blocks);
+        if (rc == 0) {
+            img.timestamp = now;
+            img.compress = (unsigned)compress;
+            rc = import_tree(&img, from_dir, threads);
+            // The import moved the allocation hints, the free counters and
+            // maybe the version, and filled data blocks to checksum.
+            if (rc == 0) image_finalize(&img);
+            image_close(&img);
+        }
+        // The mapping is the output file; unmapping leaves the image there.
+        if (unmap_output_image(image, total_blocks * bs, out_fd) != 0) rc = -1;
+        if (rc != 0) {
+            unlink(image_name);
+            return 1;
+        }
+        return 0;
+    }
+
     // Persist image
-    FILE* f = fopen(image_name, "wb");
-    if (!f) { perror("fopen"); free(image); return 1; }
-    size_t wrote = fwrite(image, BS, total_blocks, f);
-    if (wrote != total_blocks) { perror("fwrite"); fclose(f); free(image); return 1; }
-    fclose(f);
+    if (write_sparse_image(image_name, image, meta_blocks, total_blocks, bs, preallocate) != 0) {
+        free(image);
+        return 1;
+    }
     free(image);
     return 0;
 }
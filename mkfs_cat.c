@@ -0,0 +1,306 @@
+// Build: gcc -O2 -std=c17 -Wall -Wextra mkfs_cat.c minivsfs.c crc32.c compress.c -o mkfs_cat
+// Reads files back out of a MiniVSFS image, to stdout or into a host directory.
+// Metadata is read through a mapping of the image; file data is moved by the
+// kernel (copy_file_range, sendfile) straight from the image file to the
+// output, one call per contiguous run of blocks. On images with data
+// checksums each run is verified through the mapping before it is copied.
+// Compressed files are decompressed a chunk at a time and written out, and
+// inline files are written from the inode.
+// Exit status: 0 success, 1 a path was missing or unreadable, 2 usage or I/O error.
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "minivsfs.h"
+#include "bitmap.h"
+
+typedef struct {
+    int fd;
+    const uint8_t *base;
+    uint64_t total_bytes;
+    uint64_t bs;            // block size
+    int replayed;           // the mapping holds journal blocks the file lacks
+    const superblock_t *sb;
+    const inode_t *inode_table;
+} reader_t;
+
+// Copies [off, off+len) of the image to `out`. copy_file_range lets the
+// filesystem share or copy the blocks itself, sendfile covers pipes and other
+// outputs, and a write from the mapping is the last resort, or the only way
+// when a journal replay made the mapping differ from the file.
+static int copy_range(const reader_t *r, int out, uint64_t off, uint64_t len) {
+    static int use_cfr = 1, use_sendfile = 1;
+    while (len > 0) {
+        ssize_t n = -1;
+        loff_t in_off = (loff_t)off;
+        if (use_cfr && !r->replayed) {
+            n = copy_file_range(r->fd, &in_off, out, NULL, len, 0);
+            if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EBADF ||
+                          errno == EOPNOTSUPP)) {
+                use_cfr = 0;
+                continue;
+            }
+        } else if (use_sendfile && !r->replayed) {
+            off_t soff = (off_t)off;
+            n = sendfile(out, r->fd, &soff, len);
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                use_sendfile = 0;
+                continue;
+            }
+        } else {
+            n = write(out, r->base + off, len);
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            perror("Failed to write output");
+            return -1;
+        }
+        off += (uint64_t)n;
+        len -= (uint64_t)n;
+    }
+    return 0;
+}
+
+// Writes all `len` bytes of `buf` to `out`, retrying short writes.
+static int write_all(int out, const uint8_t *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(out, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            perror("Failed to write output");
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int cat_compressed(const reader_t *r, const inode_t *ino, int out, const char *path) {
+    uint8_t *chunk = malloc(COMPRESS_CHUNK), *scratch = malloc(COMPRESS_CHUNK);
+    int rc = chunk && scratch ? 0 : 2;
+    if (rc) fprintf(stderr, "Memory allocation failed.\n");
+    uint64_t nchunks = (ino->size_bytes + COMPRESS_CHUNK - 1) / COMPRESS_CHUNK;
+    for (uint64_t c = 0; rc == 0 && c < nchunks; c++) {
+        int n = compressed_chunk(r->base, ino, c, chunk, scratch);
+        if (n < 0) {
+            fprintf(stderr, "%s: compressed chunk %llu is damaged or uses an unsupported algorithm\n",
+                    path, (unsigned long long)c);
+            rc = 1;
+        } else if (write_all(out, chunk, (size_t)n) != 0) {
+            rc = 2;
+        }
+    }
+    free(chunk);
+    free(scratch);
+    return rc;
+}
+
+// Streams the contents of regular file `ino_no` to `out`.
+static int cat_inode(const reader_t *r, uint32_t ino_no, int out, const char *path) {
+    const inode_t *ino = &r->inode_table[ino_no - 1];
+    if (!inode_crc_ok(ino)) {
+        fprintf(stderr, "%s: bad inode checksum\n", path);
+        return 1;
+    }
+    if (ino->flags & INODE_FL_INLINE) return write_all(out, inode_inline_data((inode_t *)ino), ino->size_bytes) ? 2 : 0;
+    if (ino->flags & INODE_FL_COMPRESSED) return cat_compressed(r, ino, out, path);
+    uint64_t nblocks = (ino->size_bytes + r->bs - 1) / r->bs;
+    uint64_t remaining = ino->size_bytes;
+    for (uint64_t b = 0; b < nblocks;) {
+        uint32_t start = inode_bmap(r->base, ino, b);
+        if (start < r->sb->data_region_start || start >= r->sb->total_blocks) {
+            fprintf(stderr, "%s: block %llu is not mapped\n", path, (unsigned long long)b);
+            return 1;
+        }
+        uint64_t run = 1;
+        while (b + run < nblocks && start + run < r->sb->total_blocks &&
+               inode_bmap(r->base, ino, b + run) == start + run)
+            run++;
+        uint64_t len = run * r->bs < remaining ? run * r->bs : remaining;
+        uint32_t bad;
+        if (data_csum_check(r->base, start, run, &bad) != 0) {
+            fprintf(stderr, "%s: block %u fails its data checksum\n", path, bad);
+            return 1;
+        }
+        if (copy_range(r, out, start * r->bs, len) != 0) return 2;
+        remaining -= len;
+        b += run;
+    }
+    return 0;
+}
+
+// Directories nested deeper than this are taken to be a loop in a damaged image.
+#define MAX_DEPTH 256
+
+// Recreates `ino_no` (a file or a directory tree) as host path `dst`.
+static int extract(const reader_t *r, uint32_t ino_no, const char *dst, const char *path, int depth) {
+    const inode_t *ino = &r->inode_table[ino_no - 1];
+    if ((ino->mode & 0170000) == MODE_FILE) {
+        int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out < 0) {
+            perror(dst);
+            return 2;
+        }
+        int rc = cat_inode(r, ino_no, out, path);
+        if (close(out) != 0 && rc == 0) {
+            perror(dst);
+            rc = 2;
+        }
+        return rc;
+    }
+    if ((ino->mode & 0170000) != MODE_DIR) {
+        fprintf(stderr, "%s: unknown mode %06o\n", path, ino->mode);
+        return 1;
+    }
+    if (depth > MAX_DEPTH) {
+        fprintf(stderr, "%s: directories nested too deeply\n", path);
+        return 1;
+    }
+    if (mkdir(dst, 0755) != 0 && errno != EEXIST) {
+        perror(dst);
+        return 2;
+    }
+    int rc = 0;
+    uint64_t slots = ino->size_bytes / sizeof(dirent64_t);
+    for (uint64_t i = 0; i < slots; i++) {
+        const dirent64_t *de = dir_slot(r->base, ino, i);
+        if (!de) break;
+        if (de->inode_no == 0 || !strcmp(de->name, ".") || !strcmp(de->name, "..")) continue;
+        if (!dirent_checksum_ok(de) || !memchr(de->name, '\0', sizeof(de->name)) ||
+            de->inode_no > r->sb->inode_count) {
+            fprintf(stderr, "%s: bad directory entry at slot %llu\n", path, (unsigned long long)i);
+            rc = rc ? rc : 1;
+            continue;
+        }
+        char child_dst[4096], child_path[4096];
+        if (snprintf(child_dst, sizeof(child_dst), "%s/%s", dst, de->name) >= (int)sizeof(child_dst) ||
+            snprintf(child_path, sizeof(child_path), "%s/%s", path, de->name) >= (int)sizeof(child_path)) {
+            fprintf(stderr, "%s/%s: path too long\n", path, de->name);
+            rc = rc ? rc : 1;
+            continue;
+        }
+        int crc = extract(r, de->inode_no, child_dst, child_path, depth + 1);
+        if (crc > rc) rc = crc;
+    }
+    return rc;
+}
+
+static int reader_open(reader_t *r, const char *path) {
+    r->fd = open(path, O_RDONLY);
+    if (r->fd < 0) {
+        perror(path);
+        return -1;
+    }
+    superblock_t sb;
+    struct stat st;
+    if (pread(r->fd, &sb, sizeof(sb), 0) != (ssize_t)sizeof(sb) || fstat(r->fd, &st) != 0) {
+        fprintf(stderr, "%s: failed to read superblock\n", path);
+        close(r->fd);
+        return -1;
+    }
+    if (sb.magic != MVFS_MAGIC || sb.version == 0 || sb.version > MVFS_VERSION ||
+        (sb.flags & ~SB_FLAGS_KNOWN) || !block_size_valid(sb.block_size)) {
+        fprintf(stderr, "%s: not a MiniVSFS image (or an unsupported version)\n", path);
+        close(r->fd);
+        return -1;
+    }
+    r->bs = sb.block_size;
+    r->total_bytes = sb.total_blocks * r->bs;
+    if ((uint64_t)st.st_size < r->total_bytes || r->total_bytes == 0 ||
+        sb.inode_table_start + sb.inode_table_blocks > sb.total_blocks) {
+        fprintf(stderr, "%s: image is truncated or inconsistent\n", path);
+        close(r->fd);
+        return -1;
+    }
+    void *base = mmap(NULL, r->total_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, r->fd, 0);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        close(r->fd);
+        return -1;
+    }
+    r->replayed = journal_replay(base, NULL) > 0;
+    r->base = base;
+    r->sb = (const superblock_t *)r->base;
+    r->inode_table = (const inode_t *)(r->base + r->sb->inode_table_start * r->bs);
+    return 0;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: --image <img> [--extract <dir>] <path>...\n"
+                    "  Without --extract, the files are written to stdout in order.\n"
+                    "  With --extract, each path (default: /) is copied into <dir>.\n");
+}
+
+int main(int argc, char *argv[]) {
+    crc32_init();
+
+    const char *image_name = NULL, *extract_dir = NULL;
+    const char **paths = calloc((size_t)argc, sizeof(char *));
+    int npaths = 0;
+    if (!paths) return 2;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--image") && i + 1 < argc) image_name = argv[++i];
+        else if (!strcmp(argv[i], "--extract") && i + 1 < argc) extract_dir = argv[++i];
+        else if (!strncmp(argv[i], "--", 2)) {
+            usage();
+            free(paths);
+            return 2;
+        } else paths[npaths++] = argv[i];
+    }
+    if (!image_name || (!extract_dir && npaths == 0)) {
+        usage();
+        free(paths);
+        return 2;
+    }
+    if (extract_dir && npaths == 0) paths[npaths++] = "/";
+
+    reader_t r;
+    if (reader_open(&r, image_name) != 0) {
+        free(paths);
+        return 2;
+    }
+
+    int rc = 0;
+    for (int i = 0; i < npaths && rc < 2; i++) {
+        uint32_t ino = path_lookup(r.base, paths[i]);
+        if (ino == 0 || !bitmap_test(r.base + r.sb->inode_bitmap_start * r.bs, ino - 1)) {
+            fprintf(stderr, "%s: no such file in %s\n", paths[i], image_name);
+            rc = rc ? rc : 1;
+            continue;
+        }
+        int prc;
+        if (extract_dir) {
+            // A path's last component names the copy; "/" extracts into <dir> itself.
+            const char *base = strrchr(paths[i], '/');
+            base = base ? base + 1 : paths[i];
+            char dst[4096];
+            if (snprintf(dst, sizeof(dst), "%s/%s", extract_dir, base) >= (int)sizeof(dst)) {
+                fprintf(stderr, "%s: path too long\n", paths[i]);
+                prc = 1;
+            } else {
+                prc = extract(&r, ino, *base ? dst : extract_dir, paths[i], 0);
+            }
+        } else if ((r.inode_table[ino - 1].mode & 0170000) != MODE_FILE) {
+            fprintf(stderr, "%s: not a regular file\n", paths[i]);
+            prc = 1;
+        } else {
+            prc = cat_inode(&r, ino, STDOUT_FILENO, paths[i]);
+        }
+        if (prc > rc) rc = prc;
+    }
+
+    munmap((void *)r.base, r.total_bytes);
+    close(r.fd);
+    free(paths);
+    return rc;
+}
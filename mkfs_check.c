@@ -0,0 +1,610 @@
+// Build: gcc -O2 -std=c17 -Wall -Wextra -pthread mkfs_check.c minivsfs.c bitmap.c crc32.c compress.c -o mkfs_check
+// Verifies a MiniVSFS image: superblock, inode and dirent checksums, and that
+// the bitmaps agree with the blocks and inodes actually referenced.
+// Exit status: 0 clean, 1 inconsistencies found, 2 usage or I/O error.
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "minivsfs.h"
+#include "bitmap.h"
+
+typedef struct {
+    const uint8_t *base;
+    const superblock_t *sb;
+    uint64_t bs;            // block size
+    const uint8_t *inode_bitmap;
+    const uint8_t *data_bitmap;
+    const inode_t *inode_table;
+    const refcount_t *refcounts;  // SB_FLAG_DEDUP images, else NULL
+    uint32_t *block_refs;   // per data-region block: number of pointers to it
+    uint32_t *inode_refs;   // per inode: number of dirents naming it
+    int list_fragmented;
+} check_ctx_t;
+
+// Messages are collected per worker and printed in worker order, so the
+// report is the same whatever the thread count.
+typedef struct {
+    char *buf;
+    size_t len, cap;
+    uint64_t errors;
+} report_t;
+
+typedef struct {
+    const check_ctx_t *ctx;
+    uint64_t first, last;   // inode index range [first, last)
+    report_t report;
+    report_t frag;          // --frag listing; not counted as problems
+    uint64_t files, fragmented_files, extents;
+} worker_t;
+
+static void report(report_t *r, const char *fmt, ...) {
+    char line[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if ((size_t)n >= sizeof(line)) n = sizeof(line) - 1;
+    r->errors++;
+    if (r->len + n + 1 > r->cap) {
+        size_t cap = r->cap ? r->cap * 2 : 4096;
+        while (cap < r->len + n + 1) cap *= 2;
+        char *p = realloc(r->buf, cap);
+        if (!p) return;
+        r->buf = p;
+        r->cap = cap;
+    }
+    memcpy(r->buf + r->len, line, n);
+    r->len += n;
+    r->buf[r->len] = '\0';
+}
+
+static void check_dir(const check_ctx_t *ctx, report_t *r, uint64_t ino, const inode_t *dir, uint32_t nblocks) {
+    const superblock_t *sb = ctx->sb;
+    uint64_t entries = dir->size_bytes / sizeof(dirent64_t);
+    if (dir->size_bytes % sizeof(dirent64_t))
+        report(r, "inode %llu: directory size %llu is not a multiple of %zu\n",
+               (unsigned long long)ino, (unsigned long long)dir->size_bytes, sizeof(dirent64_t));
+    for (uint64_t e = 0; e < entries; e++) {
+        uint64_t blk_index = e / DIRENTS_PER_BLOCK(ctx->bs);
+        if (blk_index >= nblocks) break;
+        uint32_t blk = inode_bmap(ctx->base, dir, blk_index);
+        if (blk < sb->data_region_start || blk >= sb->total_blocks) break;
+        const dirent64_t *de = (const dirent64_t *)(ctx->base + (uint64_t)blk * ctx->bs) + e % DIRENTS_PER_BLOCK(ctx->bs);
+        if (de->inode_no == 0) continue;
+        if (!dirent_checksum_ok(de)) {
+            report(r, "inode %llu: bad dirent checksum at slot %llu\n",
+                   (unsigned long long)ino, (unsigned long long)e);
+            continue;
+        }
+        if (memchr(de->name, '\0', sizeof(de->name)) == NULL || de->name[0] == '\0') {
+            report(r, "inode %llu: dirent %llu has an invalid name\n",
+                   (unsigned long long)ino, (unsigned long long)e);
+            continue;
+        }
+        if (de->inode_no > sb->inode_count) {
+            report(r, "inode %llu: dirent '%s' points at inode %u beyond inode_count\n",
+                   (unsigned long long)ino, de->name, de->inode_no);
+            continue;
+        }
+        const inode_t *target = &ctx->inode_table[de->inode_no - 1];
+        if (!bitmap_test(ctx->inode_bitmap, de->inode_no - 1))
+            report(r, "inode %llu: dirent '%s' points at unallocated inode %u\n",
+                   (unsigned long long)ino, de->name, de->inode_no);
+        else if ((de->type == DIRENT_DIR) != ((target->mode & 0170000) == MODE_DIR) ||
+                 (de->type != DIRENT_DIR && de->type != DIRENT_FILE))
+            report(r, "inode %llu: dirent '%s' type %u does not match inode %u mode %06o\n",
+                   (unsigned long long)ino, de->name, de->type, de->inode_no, target->mode);
+        // "." and ".." do not count as links to their target.
+        if (strcmp(de->name, ".") && strcmp(de->name, ".."))
+            __atomic_fetch_add(&ctx->inode_refs[de->inode_no - 1], 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Counts a reference to `blk` from inode `ino_no`; returns 0 if it is not a data-region block.
+static int ref_block(const check_ctx_t *ctx, report_t *r, uint64_t ino_no, const char *what, uint64_t index, uint32_t blk) {
+    const superblock_t *sb = ctx->sb;
+    if (blk < sb->data_region_start || blk >= sb->total_blocks) {
+        report(r, "inode %llu: %s[%llu]=%u outside the data region\n",
+               (unsigned long long)ino_no, what, (unsigned long long)index, blk);
+        return 0;
+    }
+    __atomic_fetch_add(&ctx->block_refs[blk - sb->data_region_start], 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+// The hash index of a directory: its blocks are referenced, its header count
+// matches the table, every entry names a live dirent and every live dirent
+// can be found through it.
+static void check_dir_index(const check_ctx_t *ctx, report_t *r, uint64_t ino_no, const inode_t *dir) {
+    const superblock_t *sb = ctx->sb;
+    uint32_t start = dx_start(dir), nblocks = dx_blocks(dir);
+    if (nblocks == 0 || nblocks > DX_MAX_BLOCKS || (nblocks & (nblocks - 1)) ||
+        start < sb->data_region_start || start + (uint64_t)nblocks > sb->total_blocks) {
+        report(r, "inode %llu: bad directory index location %u+%u\n", (unsigned long long)ino_no, start, nblocks);
+        return;
+    }
+    for (uint32_t b = 0; b < nblocks; b++) ref_block(ctx, r, ino_no, "index", b, start + b);
+
+    const dx_entry_t *tab = (const dx_entry_t *)(ctx->base + (uint64_t)start * ctx->bs);
+    uint64_t slots = (uint64_t)nblocks * DX_ENTRIES_PER_BLOCK(ctx->bs);
+    uint64_t entries = dir->size_bytes / sizeof(dirent64_t);
+    uint64_t occupied = 0;
+    for (uint64_t i = 1; i < slots; i++) {
+        if (tab[i].slot == 0) continue;
+        occupied++;
+        if (tab[i].slot != DX_TOMBSTONE && tab[i].slot > entries)
+            report(r, "inode %llu: index entry %llu points past the directory end\n",
+                   (unsigned long long)ino_no, (unsigned long long)i);
+    }
+    if (occupied != tab[0].hash || occupied >= slots - 1)
+        report(r, "inode %llu: index header counts %u entries, table has %llu\n",
+               (unsigned long long)ino_no, tab[0].hash, (unsigned long long)occupied);
+    else {
+        // Lookups only terminate on an empty entry, so check names once we
+        // know one exists.
+        for (uint64_t e = 0; e < entries; e++) {
+            const dirent64_t *de = dir_slot(ctx->base, dir, e);
+            if (!de || de->inode_no == 0 || !dirent_checksum_ok(de) ||
+                memchr(de->name, '\0', sizeof(de->name)) == NULL)
+                continue;
+            if (dx_lookup(ctx->base, dir, de->name) != e)
+                report(r, "inode %llu: dirent '%s' is missing from the index\n",
+                       (unsigned long long)ino_no, de->name);
+        }
+    }
+}
+
+// Counts the indirect and double-indirect pointer blocks of an inode mapping `nblocks` data blocks.
+static void check_pointer_blocks(const check_ctx_t *ctx, report_t *r, uint64_t ino_no, const inode_t *ino, uint64_t nblocks) {
+    if (ctx->sb->version < MVFS_VERSION_INDIRECT && (ino->indirect || ino->double_indirect))
+        report(r, "inode %llu: indirect pointers in a version %u image\n", (unsigned long long)ino_no, ctx->sb->version);
+    if (nblocks <= DIRECT_MAX) {
+        if (ino->indirect || ino->double_indirect)
+            report(r, "inode %llu: indirect pointers set beyond file size\n", (unsigned long long)ino_no);
+        return;
+    }
+    uint64_t ptrs = PTRS_PER_BLOCK(ctx->bs);
+    ref_block(ctx, r, ino_no, "indirect", 0, ino->indirect);
+    if (nblocks <= DIRECT_MAX + ptrs) {
+        if (ino->double_indirect)
+            report(r, "inode %llu: double-indirect pointer set beyond file size\n", (unsigned long long)ino_no);
+        return;
+    }
+    if (!ref_block(ctx, r, ino_no, "double_indirect", 0, ino->double_indirect)) return;
+    const uint32_t *dind = (const uint32_t *)(ctx->base + (uint64_t)ino->double_indirect * ctx->bs);
+    uint64_t children = (nblocks - DIRECT_MAX - ptrs + ptrs - 1) / ptrs;
+    for (uint64_t c = 0; c < children; c++) ref_block(ctx, r, ino_no, "double_indirect", c, dind[c]);
+}
+
+// Validates the extent list of an extent-mapped inode against `nblocks`.
+static void check_extents(const check_ctx_t *ctx, report_t *r, uint64_t ino_no, const inode_t *ino, uint64_t nblocks) {
+    const superblock_t *sb = ctx->sb;
+    if (!(sb->flags & SB_FLAG_EXTENTS))
+        report(r, "inode %llu: extent-mapped in an image without the extents feature\n", (unsigned long long)ino_no);
+    if (ino->double_indirect)
+        report(r, "inode %llu: double-indirect pointer set on an extent-mapped inode\n", (unsigned long long)ino_no);
+    if (ino->indirect && !ref_block(ctx, r, ino_no, "extent block", 0, ino->indirect)) return;
+    uint64_t mapped = 0, limit = ino->indirect ? INODE_MAX_EXTENTS(ctx->bs) : INODE_EXTENTS;
+    for (uint64_t i = 0; i < limit; i++) {
+        const extent_t *e = inode_extent(ctx->base, ino, i);
+        if (!e || e->len == 0) break;
+        if (e->start < sb->data_region_start || (uint64_t)e->start + e->len > sb->total_blocks)
+            report(r, "inode %llu: extent %llu (%u+%u) outside the data region\n",
+                   (unsigned long long)ino_no, (unsigned long long)i, e->start, e->len);
+        mapped += e->len;
+    }
+    if (mapped != nblocks)
+        report(r, "inode %llu: extents map %llu blocks, size needs %llu\n", (unsigned long long)ino_no,
+               (unsigned long long)mapped, (unsigned long long)nblocks);
+}
+
+// A compressed file: its chunk table fits the stored stream and every chunk
+// decompresses to its full length.
+static void check_compressed(const check_ctx_t *ctx, report_t *r, uint64_t ino_no, const inode_t *ino) {
+    if (!(ctx->sb->flags & SB_FLAG_COMPRESS))
+        report(r, "inode %llu: compressed in an image without the compression feature\n", (unsigned long long)ino_no);
+    if ((ino->mode & 0170000) != MODE_FILE) {
+        report(r, "inode %llu: compressed flag on a directory\n", (unsigned long long)ino_no);
+        return;
+    }
+    unsigned alg = inode_compress_alg(ino);
+    if (!compress_available(alg)) {
+        report(r, "inode %llu: compression algorithm %u is not supported by this build\n",
+               (unsigned long long)ino_no, alg);
+        return;
+    }
+    uint8_t *chunk = malloc(COMPRESS_CHUNK), *scratch = malloc(COMPRESS_CHUNK);
+    uint64_t nchunks = (ino->size_bytes + COMPRESS_CHUNK - 1) / COMPRESS_CHUNK;
+    for (uint64_t c = 0; chunk && scratch && c < nchunks; c++) {
+        if (compressed_chunk(ctx->base, ino, c, chunk, scratch) < 0) {
+            report(r, "inode %llu: compressed chunk %llu is damaged\n", (unsigned long long)ino_no,
+                   (unsigned long long)c);
+            break;
+        }
+    }
+    if (!chunk || !scratch) report(r, "inode %llu: out of memory checking compressed data\n", (unsigned long long)ino_no);
+    free(chunk);
+    free(scratch);
+}
+
+// An inline file: within the inline area, zero past its end, and with no
+// other mapping flags.
+static void check_inline(const check_ctx_t *ctx, report_t *r, uint64_t ino_no, const inode_t *ino) {
+    if (!(ctx->sb->flags & SB_FLAG_INLINE_DATA))
+        report(r, "inode %llu: inline data in an image without the inline-data feature\n", (unsigned long long)ino_no);
+    if ((ino->mode & 0170000) != MODE_FILE || (ino->flags & (INODE_FL_EXTENTS | INODE_FL_COMPRESSED)) ||
+        ino->size_bytes > INODE_INLINE_MAX) {
+        report(r, "inode %llu: inline flag on a %s of %llu bytes (flags %#x)\n", (unsigned long long)ino_no,
+               (ino->mode & 0170000) == MODE_FILE ? "file" : "directory", (unsigned long long)ino->size_bytes,
+               ino->flags);
+        return;
+    }
+    const uint8_t *data = inode_inline_data((inode_t *)ino);
+    for (uint64_t b = ino->size_bytes; b < INODE_INLINE_MAX; b++) {
+        if (data[b]) {
+            report(r, "inode %llu: inline data past the file size\n", (unsigned long long)ino_no);
+            break;
+        }
+    }
+}
+
+static void check_inode(const check_ctx_t *ctx, worker_t *w, uint64_t i) {
+    report_t *r = &w->report;
+    const inode_t *ino = &ctx->inode_table[i];
+    uint64_t ino_no = i + 1;
+
+    if (!bitmap_test(ctx->inode_bitmap, i)) return;
+    if (!inode_crc_ok(ino)) {
+        report(r, "inode %llu: bad inode checksum\n", (unsigned long long)ino_no);
+        return;
+    }
+    uint16_t type = ino->mode & 0170000;
+    if (type != MODE_FILE && type != MODE_DIR) {
+        report(r, "inode %llu: unknown mode %06o\n", (unsigned long long)ino_no, ino->mode);
+        return;
+    }
+
+    if (ino->flags & INODE_FL_INLINE) {
+        check_inline(ctx, r, ino_no, ino);
+        return;
+    }
+    uint64_t nblocks = inode_data_blocks(ino, ctx->bs);
+    if (type == MODE_DIR && nblocks == 0) nblocks = 1;
+    if (nblocks > INODE_MAX_BLOCKS(ctx->bs)) {
+        report(r, "inode %llu: size %llu needs more than %llu blocks\n", (unsigned long long)ino_no,
+               (unsigned long long)ino->size_bytes, (unsigned long long)INODE_MAX_BLOCKS(ctx->bs));
+        nblocks = INODE_MAX_BLOCKS(ctx->bs);
+    }
+    const int extents_mapped = (ino->flags & INODE_FL_EXTENTS) != 0;
+    if (extents_mapped) {
+        check_extents(ctx, r, ino_no, ino, nblocks);
+    } else {
+        for (uint64_t b = nblocks; b < DIRECT_MAX; b++) {
+            if (ino->direct[b] != 0)
+                report(r, "inode %llu: direct[%llu]=%u set beyond file size\n",
+                       (unsigned long long)ino_no, (unsigned long long)b, ino->direct[b]);
+        }
+        check_pointer_blocks(ctx, r, ino_no, ino, nblocks);
+    }
+
+    uint64_t extents = 0;
+    uint32_t prev = 0;
+    for (uint64_t b = 0; b < nblocks; b++) {
+        uint32_t blk = inode_bmap(ctx->base, ino, b);
+        if (!ref_block(ctx, r, ino_no, "block", b, blk)) continue;
+        // Pointer blocks laid out just before block b do not break the extent.
+        uint64_t gap = extents_mapped ? 1 : 1 + inode_pointer_blocks(b + 1, ctx->bs) - inode_pointer_blocks(b, ctx->bs);
+        if (b == 0 || blk != prev + gap) extents++;
+        prev = blk;
+    }
+    if (type == MODE_FILE && nblocks > 0) {
+        w->files++;
+        w->extents += extents;
+        if (extents > 1) {
+            w->fragmented_files++;
+            if (ctx->list_fragmented)
+                report(&w->frag, "inode %llu: %llu blocks in %llu fragments\n", (unsigned long long)ino_no,
+                       (unsigned long long)nblocks, (unsigned long long)extents);
+        }
+    }
+    if (type == MODE_DIR) check_dir(ctx, r, ino_no, ino, (uint32_t)nblocks);
+    if (ino->flags & INODE_FL_COMPRESSED) check_compressed(ctx, r, ino_no, ino);
+    else if (ino->xattr_ptr) {
+        if (type != MODE_DIR || !(ctx->sb->flags & SB_FLAG_DIR_INDEX))
+            report(r, "inode %llu: xattr_ptr set without a directory index\n", (unsigned long long)ino_no);
+        else
+            check_dir_index(ctx, r, ino_no, ino);
+    }
+}
+
+static void *worker_main(void *arg) {
+    worker_t *w = arg;
+    for (uint64_t i = w->first; i < w->last; i++) check_inode(w->ctx, w, i);
+    return NULL;
+}
+
+static int check_superblock(const superblock_t *sb, uint64_t file_bytes, report_t *r) {
+    if (sb->magic != MVFS_MAGIC) {
+        report(r, "superblock: bad magic 0x%08x\n", sb->magic);
+        return -1;
+    }
+    if (sb->version == 0 || sb->version > MVFS_VERSION) {
+        report(r, "superblock: unsupported version %u\n", sb->version);
+        return -1;
+    }
+    if (sb->flags & ~SB_FLAGS_KNOWN) {
+        report(r, "superblock: unknown feature flags 0x%x\n", sb->flags & ~SB_FLAGS_KNOWN);
+        return -1;
+    }
+    if (!block_size_valid(sb->block_size) || sb->block_size > file_bytes) {
+        report(r, "superblock: unsupported block size %u\n", sb->block_size);
+        return -1;
+    }
+    uint64_t bs = sb->block_size;
+    if (!superblock_crc_ok(sb)) report(r, "superblock: bad checksum\n");
+    if (sb->total_blocks > UINT64_MAX / bs || sb->total_blocks * bs > file_bytes) {
+        report(r, "superblock: total_blocks %llu exceeds the image size\n", (unsigned long long)sb->total_blocks);
+        return -1;
+    }
+    if (sb->inode_bitmap_start + sb->inode_bitmap_blocks > sb->total_blocks ||
+        sb->data_bitmap_start + sb->data_bitmap_blocks > sb->total_blocks ||
+        sb->inode_table_start + sb->inode_table_blocks > sb->data_region_start ||
+        sb->data_region_start + sb->data_region_blocks != sb->total_blocks ||
+        sb->inode_count > sb->inode_bitmap_blocks * bs * 8 ||
+        sb->inode_count * INODE_SIZE > sb->inode_table_blocks * bs ||
+        sb->data_region_blocks > sb->data_bitmap_blocks * bs * 8) {
+        report(r, "superblock: inconsistent layout\n");
+        return -1;
+    }
+    const superblock_ext_t *ext = sb_ext((superblock_t *)sb);
+    if ((sb->flags & SB_FLAG_DEDUP) &&
+        (ext->refcount_start < sb->inode_table_start + sb->inode_table_blocks ||
+         ext->refcount_start + ext->refcount_blocks > sb->data_region_start ||
+         (uint64_t)ext->refcount_blocks * REFCOUNTS_PER_BLOCK(bs) < sb->data_region_blocks)) {
+        report(r, "superblock: bad refcount table location %llu+%u\n",
+               (unsigned long long)ext->refcount_start, ext->refcount_blocks);
+        return -1;
+    }
+    if ((sb->flags & SB_FLAG_DATA_CSUM) &&
+        (ext->csum_start < sb->inode_table_start + sb->inode_table_blocks ||
+         ext->csum_start + ext->csum_blocks > sb->data_region_start ||
+         (uint64_t)ext->csum_blocks * CSUMS_PER_BLOCK(bs) < sb->data_region_blocks)) {
+        report(r, "superblock: bad checksum table location %llu+%u\n",
+               (unsigned long long)ext->csum_start, ext->csum_blocks);
+        return -1;
+    }
+    if ((sb->flags & SB_FLAG_JOURNAL) &&
+        (ext->journal_start < sb->inode_table_start + sb->inode_table_blocks ||
+         ext->journal_start + ext->journal_blocks > sb->data_region_start ||
+         ext->journal_blocks < JOURNAL_MIN_BLOCKS || ext->journal_blocks > JOURNAL_MAX_BLOCKS(bs))) {
+        report(r, "superblock: bad journal location %llu+%u\n",
+               (unsigned long long)ext->journal_start, ext->journal_blocks);
+        return -1;
+    }
+    if (sb->root_inode != ROOT_INO) report(r, "superblock: root inode is %llu, expected %u\n",
+                                           (unsigned long long)sb->root_inode, ROOT_INO);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    crc32_init();
+
+    const char *image_name = NULL;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int list_fragmented = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--image") && i + 1 < argc) image_name = argv[++i];
+        else if (!strcmp(argv[i], "--threads") && i + 1 < argc) threads = strtol(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--frag")) list_fragmented = 1;
+        else {
+            fprintf(stderr, "Unknown or incomplete flag near '%s'\n", argv[i]);
+            return 2;
+        }
+    }
+    if (!image_name || threads < 1) {
+        fprintf(stderr, "Usage: --image <img> [--threads <n>] [--frag]\n");
+        return 2;
+    }
+
+    int fd = open(image_name, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) { perror("open"); return 2; }
+    if ((uint64_t)st.st_size < BS_MIN) {
+        fprintf(stderr, "Image is smaller than one block.\n");
+        close(fd);
+        return 2;
+    }
+    // Private and writable, so a pending journal transaction can be laid
+    // over it: the image is checked as the next open will see it.
+    uint8_t *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) { perror("mmap"); return 2; }
+
+    report_t sb_report = {0};
+    const superblock_t *sb = (const superblock_t *)base;
+    if (sb->magic == MVFS_MAGIC && block_size_valid(sb->block_size) &&
+        sb->total_blocks <= (uint64_t)st.st_size / sb->block_size) {
+        uint64_t replayed = journal_replay(base, NULL);
+        if (replayed > 0)
+            printf("%s: journal: %llu block(s) of the last transactions were not in place yet, checking with them\n",
+                   image_name, (unsigned long long)replayed);
+    }
+    if (check_superblock(sb, (uint64_t)st.st_size, &sb_report) != 0) {
+        fputs(sb_report.buf, stdout);
+        printf("%s: superblock unusable, giving up\n", image_name);
+        return 1;
+    }
+
+    uint64_t bs = sb->block_size;
+    check_ctx_t ctx = {
+        .base = base,
+        .sb = sb,
+        .bs = bs,
+        .inode_bitmap = base + sb->inode_bitmap_start * bs,
+        .data_bitmap = base + sb->data_bitmap_start * bs,
+        .inode_table = (const inode_t *)(base + sb->inode_table_start * bs),
+        .refcounts = (sb->flags & SB_FLAG_DEDUP)
+            ? (const refcount_t *)(base + sb_ext((superblock_t *)sb)->refcount_start * bs) : NULL,
+        .block_refs = calloc(sb->data_region_blocks, sizeof(uint32_t)),
+        .inode_refs = calloc(sb->inode_count, sizeof(uint32_t)),
+        .list_fragmented = list_fragmented,
+    };
+    if (!ctx.block_refs || !ctx.inode_refs) { fprintf(stderr, "Memory allocation failed.\n"); return 2; }
+
+    // Scan the inode table in contiguous slices, one per worker.
+    if ((uint64_t)threads > sb->inode_count) threads = (long)sb->inode_count;
+    if (threads < 1) threads = 1;
+    worker_t *workers = calloc(threads, sizeof(worker_t));
+    pthread_t *tids = calloc(threads, sizeof(pthread_t));
+    if (!workers || !tids) { fprintf(stderr, "Memory allocation failed.\n"); return 2; }
+    uint64_t per = (sb->inode_count + threads - 1) / threads;
+    for (long t = 0; t < threads; t++) {
+        workers[t].ctx = &ctx;
+        workers[t].first = t * per;
+        workers[t].last = (t + 1) * per < sb->inode_count ? (t + 1) * per : sb->inode_count;
+        if (t > 0 && pthread_create(&tids[t], NULL, worker_main, &workers[t]) != 0) {
+            fprintf(stderr, "pthread_create failed; scanning on the main thread.\n");
+            worker_main(&workers[t]);
+            workers[t].first = workers[t].last;
+        }
+    }
+    worker_main(&workers[0]);
+    for (long t = 1; t < threads; t++)
+        if (workers[t].first != workers[t].last) pthread_join(tids[t], NULL);
+
+    // Cross-check bitmaps against what the inodes referenced.
+    report_t final = {0};
+    const inode_t *root = &ctx.inode_table[ROOT_INO - 1];
+    if (!bitmap_test(ctx.inode_bitmap, ROOT_INO - 1) || (root->mode & 0170000) != MODE_DIR)
+        report(&final, "root inode %u is not an allocated directory\n", ROOT_INO);
+    uint64_t leaked = 0, doubled = 0, unmarked = 0, orphans = 0, used_blocks = 0, used_inodes = 0;
+    for (uint64_t b = 0; b < sb->data_region_blocks; b++) {
+        int marked = bitmap_test(ctx.data_bitmap, b);
+        uint32_t refs = ctx.block_refs[b];
+        used_blocks += marked;
+        // On dedup images a block may be shared as often as its refcount says.
+        if (ctx.refcounts && refs > 0 && ctx.refcounts[b] != refs) {
+            report(&final, "block %llu: %u references but refcount %u\n",
+                   (unsigned long long)(sb->data_region_start + b), refs, ctx.refcounts[b]);
+            if (ctx.refcounts[b] < refs) doubled++;
+        }
+        if (ctx.refcounts && !marked && ctx.refcounts[b] != 0)
+            report(&final, "block %llu: free but refcount %u\n",
+                   (unsigned long long)(sb->data_region_start + b), ctx.refcounts[b]);
+        if (marked && refs == 0) {
+            report(&final, "block %llu: allocated in bitmap but unreferenced (leaked)\n",
+                   (unsigned long long)(sb->data_region_start + b));
+            leaked++;
+        } else if (refs > 1 && !ctx.refcounts) {
+            report(&final, "block %llu: referenced by %u inodes (double-allocated)\n",
+                   (unsigned long long)(sb->data_region_start + b), refs);
+            doubled++;
+        }
+        if (!marked && refs > 0) {
+            report(&final, "block %llu: in use but free in bitmap\n",
+                   (unsigned long long)(sb->data_region_start + b));
+            unmarked++;
+        }
+    }
+    for (uint64_t b = sb->data_region_blocks; b < sb->data_bitmap_blocks * bs * 8; b++) {
+        if (bitmap_test(ctx.data_bitmap, b)) {
+            report(&final, "data bitmap: bit %llu set beyond the data region\n", (unsigned long long)b);
+            break;
+        }
+    }
+    for (uint64_t i = 0; i < sb->inode_count; i++) {
+        if (!bitmap_test(ctx.inode_bitmap, i)) continue;
+        used_inodes++;
+        const inode_t *ino = &ctx.inode_table[i];
+        if (i == ROOT_INO - 1) continue;
+        if (ctx.inode_refs[i] == 0) {
+            report(&final, "inode %llu: allocated but not in any directory (orphan)\n", (unsigned long long)(i + 1));
+            orphans++;
+        } else if ((ino->mode & 0170000) == MODE_FILE && ino->links != ctx.inode_refs[i]) {
+            report(&final, "inode %llu: link count %u but %u directory entries\n",
+                   (unsigned long long)(i + 1), ino->links, ctx.inode_refs[i]);
+        }
+    }
+    for (uint64_t i = sb->inode_count; i < sb->inode_bitmap_blocks * bs * 8; i++) {
+        if (bitmap_test(ctx.inode_bitmap, i)) {
+            report(&final, "inode bitmap: bit %llu set beyond inode_count\n", (unsigned long long)i);
+            break;
+        }
+    }
+    const superblock_ext_t *ext = sb_ext((superblock_t *)sb);
+    if (ext->ext_flags & SB_EXT_FREE_COUNTS) {
+        if (ext->free_inodes != sb->inode_count - used_inodes)
+            report(&final, "superblock: free inode count %llu, bitmap has %llu\n",
+                   (unsigned long long)ext->free_inodes, (unsigned long long)(sb->inode_count - used_inodes));
+        if (ext->free_blocks != sb->data_region_blocks - used_blocks)
+            report(&final, "superblock: free block count %llu, bitmap has %llu\n",
+                   (unsigned long long)ext->free_blocks, (unsigned long long)(sb->data_region_blocks - used_blocks));
+    }
+    // Verify allocated blocks against their checksums a run at a time,
+    // restarting after each mismatch.
+    for (uint64_t b = 0; (sb->flags & SB_FLAG_DATA_CSUM) && b < sb->data_region_blocks;) {
+        if (!bitmap_test(ctx.data_bitmap, b)) {
+            b++;
+            continue;
+        }
+        uint64_t end = b + 1;
+        while (end < sb->data_region_blocks && bitmap_test(ctx.data_bitmap, end)) end++;
+        uint32_t bad;
+        if (data_csum_check(base, (uint32_t)(sb->data_region_start + b), end - b, &bad) != 0) {
+            report(&final, "block %u: data checksum mismatch\n", bad);
+            b = bad - sb->data_region_start + 1;
+        } else {
+            b = end;
+        }
+    }
+
+    uint64_t errors = sb_report.errors + final.errors;
+    uint64_t files = 0, fragmented_files = 0, extents = 0;
+    if (sb_report.buf) fputs(sb_report.buf, stdout);
+    for (long t = 0; t < threads; t++) {
+        if (workers[t].report.buf) fputs(workers[t].report.buf, stdout);
+        errors += workers[t].report.errors;
+        files += workers[t].files;
+        fragmented_files += workers[t].fragmented_files;
+        extents += workers[t].extents;
+        free(workers[t].report.buf);
+    }
+    if (final.buf) fputs(final.buf, stdout);
+    for (long t = 0; t < threads; t++) {
+        if (workers[t].frag.buf) fputs(workers[t].frag.buf, stdout);
+        free(workers[t].frag.buf);
+    }
+    bitmap_run_stats_t free_runs;
+    bitmap_free_runs(ctx.data_bitmap, sb->data_region_blocks, &free_runs);
+    printf("%s: fragmentation: %llu of %llu files fragmented, %.2f extents per file; "
+           "free space: %llu blocks in %llu runs, largest run %llu blocks\n",
+           image_name, (unsigned long long)fragmented_files, (unsigned long long)files,
+           files ? (double)extents / files : 0.0, (unsigned long long)free_runs.free_bits,
+           (unsigned long long)free_runs.runs, (unsigned long long)free_runs.largest_run);
+    printf("%s: %llu/%llu inodes, %llu/%llu data blocks used; "
+           "%llu leaked, %llu double-allocated, %llu unmarked blocks, %llu orphan inodes; %llu problem(s)\n",
+           image_name, (unsigned long long)used_inodes, (unsigned long long)sb->inode_count,
+           (unsigned long long)used_blocks, (unsigned long long)sb->data_region_blocks,
+           (unsigned long long)leaked, (unsigned long long)doubled, (unsigned long long)unmarked,
+           (unsigned long long)orphans, (unsigned long long)errors);
+
+    free(sb_report.buf);
+    free(final.buf);
+    free(workers);
+    free(tids);
+    free(ctx.block_refs);
+    free(ctx.inode_refs);
+    munmap((void *)base, st.st_size);
+    return errors ? 1 : 0;
+}
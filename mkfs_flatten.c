@@ -0,0 +1,180 @@
+// Build: gcc -O2 -std=c17 -Wall -Wextra -pthread mkfs_flatten.c image.c minivsfs.c bitmap.c crc32.c compress.c -o mkfs_flatten
+// Turns a base image and a chain of deltas (mkfs_adder --delta-output) back
+// into one full image. The base is cloned with FICLONE where the filesystem
+// supports it, and each delta's blocks are copied with copy_file_range, so on
+// reflink-capable filesystems the output shares its data with the inputs.
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "minivsfs.h"
+#include "bitmap.h"
+#include "image.h"
+
+// Copies the blocks stored in delta `path` over the image open as `out`, which
+// has `bs`-byte blocks. `*checksum` is the superblock checksum of the image so
+// far and becomes that of the result.
+static int apply_delta(int out, const char *path, uint64_t total_blocks, uint64_t bs, uint32_t *checksum) {
+    delta_header_t hdr;
+    uint8_t *map;
+    int fd = delta_open(path, (uint32_t)bs, &hdr, &map);
+    if (fd < 0) return -1;
+    int rc = 0;
+    if (hdr.total_blocks != total_blocks || hdr.base_checksum != *checksum) {
+        fprintf(stderr, "%s: delta does not follow the previous image in the chain.\n", path);
+        rc = -1;
+    }
+    uint64_t off = (1 + hdr.map_blocks) * bs;
+    for (uint64_t b = 0; rc == 0 && b < total_blocks;) {
+        if (!bitmap_test(map, b)) {
+            b++;
+            continue;
+        }
+        uint64_t run = b;
+        while (run < total_blocks && bitmap_test(map, run)) run++;
+        if (file_copy_range(fd, off, out, b * bs, (run - b) * bs) != 0) {
+            perror(path);
+            rc = -1;
+        }
+        off += (run - b) * bs;
+        b = run;
+    }
+    *checksum = hdr.result_checksum;
+    free(map);
+    close(fd);
+    return rc;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: --base <base.img> --output <out.img> <delta>...\n"
+                    "  Deltas are applied in the order given, oldest first.\n");
+}
+
+int main(int argc, char *argv[]) {
+    crc32_init();
+
+    const char *base_img = NULL, *output_img = NULL;
+    const char **deltas = calloc((size_t)argc, sizeof(char *));
+    int ndeltas = 0;
+    if (!deltas) return 1;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--base") && i + 1 < argc) base_img = argv[++i];
+        else if (!strcmp(argv[i], "--output") && i + 1 < argc) output_img = argv[++i];
+        else if (!strncmp(argv[i], "--", 2)) {
+            usage();
+            free(deltas);
+            return 1;
+        } else deltas[ndeltas++] = argv[i];
+    }
+    if (!base_img || !output_img) {
+        usage();
+        free(deltas);
+        return 1;
+    }
+
+    // Truncating the output would destroy the base before it is read.
+    struct stat base_st, out_st;
+    if (stat(base_img, &base_st) == 0 && stat(output_img, &out_st) == 0 &&
+        base_st.st_dev == out_st.st_dev && base_st.st_ino == out_st.st_ino) {
+        fprintf(stderr, "--output must not be the base image.\n");
+        free(deltas);
+        return 1;
+    }
+
+    int in = open(base_img, O_RDONLY);
+    if (in < 0) {
+        perror(base_img);
+        free(deltas);
+        return 1;
+    }
+    // Checked as image_load does, plus the superblock checksum, since the
+    // base is copied wholesale rather than parsed.
+    superblock_t sb;
+    uint8_t *block0 = NULL;
+    struct stat in_st;
+    int ok = pread(in, &sb, sizeof(sb), 0) == (ssize_t)sizeof(sb) && fstat(in, &in_st) == 0 &&
+             sb.magic == MVFS_MAGIC && sb.version != 0 && sb.version <= MVFS_VERSION &&
+             !(sb.flags & ~SB_FLAGS_KNOWN) && block_size_valid(sb.block_size) && sb.total_blocks != 0 &&
+             (uint64_t)in_st.st_size >= sb.total_blocks * sb.block_size;
+    if (ok) {
+        block0 = malloc(sb.block_size);
+        ok = block0 && pread(in, block0, sb.block_size, 0) == (ssize_t)sb.block_size &&
+             superblock_crc_ok((const superblock_t *)block0);
+        free(block0);
+    }
+    if (!ok) {
+        fprintf(stderr, "%s: not a MiniVSFS image, an unsupported version, or damaged.\n", base_img);
+        close(in);
+        free(deltas);
+        return 1;
+    }
+    // The result is built next to the output and renamed over it only once
+    // it is complete, so a failure leaves an existing output untouched.
+    size_t len = strlen(output_img);
+    char *tmp_img = malloc(len + sizeof(".XXXXXX"));
+    int out = -1;
+    if (tmp_img) {
+        memcpy(tmp_img, output_img, len);
+        memcpy(tmp_img + len, ".XXXXXX", sizeof(".XXXXXX"));
+        out = mkstemp(tmp_img);
+    }
+    if (out < 0) {
+        perror(output_img);
+        free(tmp_img);
+        close(in);
+        free(deltas);
+        return 1;
+    }
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(out, 0644 & ~mask);
+
+    int rc = 0;
+    uint64_t total_bytes = sb.total_blocks * sb.block_size;
+    if (ioctl(out, FICLONE, in) != 0 && file_copy_range(in, 0, out, 0, total_bytes) != 0) {
+        perror("Failed to copy base image");
+        rc = 1;
+    }
+    if (rc == 0 && ftruncate(out, (off_t)total_bytes) != 0) {
+        perror(tmp_img);
+        rc = 1;
+    }
+    // A transaction still pending in the base's journal is part of the base;
+    // the deltas were made against the image with it replayed.
+    if (rc == 0 && (sb.flags & SB_FLAG_JOURNAL)) {
+        uint8_t *map = mmap(NULL, total_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, out, 0);
+        if (map == MAP_FAILED) {
+            perror(tmp_img);
+            rc = 1;
+        } else {
+            journal_replay(map, NULL);
+            memcpy(&sb, map, sizeof(sb));
+            munmap(map, total_bytes);
+        }
+    }
+    uint32_t checksum = sb.checksum;
+    for (int i = 0; rc == 0 && i < ndeltas; i++)
+        if (apply_delta(out, deltas[i], sb.total_blocks, sb.block_size, &checksum) != 0) rc = 1;
+    if (close(out) != 0 && rc == 0) {
+        perror(tmp_img);
+        rc = 1;
+    }
+    if (rc == 0 && rename(tmp_img, output_img) != 0) {
+        perror(output_img);
+        rc = 1;
+    }
+    if (rc != 0) unlink(tmp_img);
+    free(tmp_img);
+    close(in);
+    free(deltas);
+    return rc;
+}
@@ -0,0 +1,76 @@
+// Build: gcc -O2 -std=c17 -Wall -Wextra -pthread mkfs_rm.c image.c minivsfs.c bitmap.c crc32.c compress.c -o mkfs_rm
+// Removes files from a MiniVSFS image. Each file's directory entry is cleared
+// for reuse and, with its last link gone, its inode and blocks are freed.
+// Like mkfs_adder, nothing is written unless every path was removed.
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "minivsfs.h"
+#include "image.h"
+
+static void usage(void) {
+    fprintf(stderr, "Usage: --input <in.img> (--output <out.img> | --in-place) "
+                    "[--source-date-epoch <seconds>] <path>...\n");
+}
+
+int main(int argc, char* argv[]) {
+    crc32_init();
+
+    const char *input_img = NULL, *output_img = NULL, *source_date = NULL;
+    file_list_t paths = {0};
+    int in_place = 0;
+    int rc = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--in-place")) in_place = 1;
+        else if (!strcmp(argv[i], "--input") && i + 1 < argc) input_img = argv[++i];
+        else if (!strcmp(argv[i], "--output") && i + 1 < argc) output_img = argv[++i];
+        else if (!strcmp(argv[i], "--source-date-epoch") && i + 1 < argc) source_date = argv[++i];
+        else if (!strncmp(argv[i], "--", 2)) {
+            usage();
+            goto out;
+        } else if (file_list_push(&paths, argv[i]) != 0) {
+            fprintf(stderr, "Memory allocation failed.\n");
+            goto out;
+        }
+    }
+
+    if (!input_img || (!output_img == !in_place) || paths.count == 0) {
+        fprintf(stderr, "Missing required arguments.\n");
+        usage();
+        goto out;
+    }
+
+    struct stat in_st, out_st;
+    if (output_img && stat(input_img, &in_st) == 0 && stat(output_img, &out_st) == 0 &&
+        in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino) {
+        in_place = 1;
+    }
+
+    uint64_t timestamp;
+    int reproducible;
+    if (image_timestamp(source_date, &timestamp, &reproducible) != 0) goto out;
+
+    image_t img;
+    if (image_load(&img, input_img, in_place) != 0) goto out;
+    img.timestamp = timestamp;
+
+    for (size_t i = 0; i < paths.count; i++) {
+        if (remove_file(&img, paths.paths[i]) != 0) {
+            image_close(&img);
+            goto out;
+        }
+    }
+
+    image_finalize(&img);
+    if ((in_place ? image_store_in_place(&img, img.fd) : image_store(&img, output_img)) == 0) rc = 0;
+    image_close(&img);
+out:
+    file_list_free(&paths);
+    return rc;
+}